@@ -0,0 +1,70 @@
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../src/aes.h"
+#include "../src/alphabet.h"
+#include "../src/engine.h"
+#include "../src/threadpool.h"
+
+// Prints generation throughput of every content engine and of both AES paths
+
+static const size_t benchSize = 64 << 20;
+
+template<class F>
+static double throughput(size_t bytes, F &&f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return bytes / elapsed.count() / (1 << 20);
+}
+
+static void report(const std::string &name, double mbps) {
+    std::cout << std::left << std::setw(24) << name << std::right << std::fixed << std::setprecision(1)
+              << std::setw(10) << mbps << " MiB/s" << std::endl;
+}
+
+int main() {
+    std::vector<char> book(benchSize);
+    for (auto engine : ContentEngine::all()) {
+        report(std::string(engine->name()), throughput(book.size(), [&] {
+            engine->generate("bench:book", 0, book.data(), book.size());
+        }));
+    }
+
+    for (auto engine : ContentEngine::all()) {
+        if (!engine->supportsAlphabets()) {
+            continue;
+        }
+        report(std::string(engine->name()) + " binary", throughput(book.size(), [&] {
+            engine->generate(libraryKey("bench:book"), 0, book.data(), book.size(), Alphabet::binary());
+        }));
+    }
+
+    auto threads = std::thread::hardware_concurrency();
+    if (threads > 1) {
+        ThreadPool pool(threads);
+        for (auto engine : ContentEngine::all()) {
+            if (!engine->isRandomAccess()) {
+                continue;
+            }
+            report(std::string(engine->name()) + " x" + std::to_string(threads), throughput(book.size(), [&] {
+                engine->generate(pool, libraryKey("bench:book"), 0, book.data(), book.size());
+            }));
+        }
+    }
+
+    Aes128 aes(Aes128::Key{});
+    std::vector<uint8_t> keystream(benchSize);
+    if (Aes128::hasHardwareSupport()) {
+        report("aes keystream (AES-NI)", throughput(keystream.size(), [&] {
+            aes.ctr(true, 0, keystream.size() / 16, keystream.data());
+        }));
+    }
+    report("aes keystream (soft)", throughput(keystream.size(), [&] {
+        aes.ctr(false, 0, keystream.size() / 16, keystream.data());
+    }));
+    return 0;
+}
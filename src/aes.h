@@ -0,0 +1,30 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// AES-128 in counter mode. The AES-NI and the table-free software paths produce
+// identical keystreams, the software one is used when the CPU lacks AES-NI.
+class Aes128 {
+public:
+    using Key = std::array<uint8_t, 16>;
+
+    explicit Aes128(const Key &key);
+
+    static bool hasHardwareSupport();
+
+    void encryptBlock(const uint8_t *in, uint8_t *out) const;
+
+    void encryptBlock(bool hardware, const uint8_t *in, uint8_t *out) const;
+
+    // Writes the encryptions of the 128-bit little-endian counters first, first + 1, ...
+    void ctr(uint64_t first, size_t blocks, uint8_t *out) const;
+
+    void ctr(bool hardware, uint64_t first, size_t blocks, uint8_t *out) const;
+
+private:
+    static const int rounds = 10;
+
+    alignas(16) std::array<uint8_t, 16 * (rounds + 1)> roundKeys;
+};
@@ -0,0 +1,226 @@
+#include "alphabet.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BABYLONFS_X86
+#endif
+
+static_assert(possibleSymbols.size() > 16 && possibleSymbols.size() <= 32,
+              "shuffle kernels look symbols up in two 16-byte tables");
+
+// Alphabets of up to 32 symbols are looked up with byte shuffles, larger ones
+// get their indices computed in vectors and looked up one by one
+static const uint32_t shuffleSymbols = 32;
+
+namespace {
+
+// Symbols of an alphabet, table holds at least shuffleSymbols bytes
+struct SymbolTable {
+    const char *table;
+    uint32_t count;
+};
+
+const SymbolTable &standardTable() {
+    static const std::string padded = [] {
+        std::string res(possibleSymbols);
+        res.resize(shuffleSymbols);
+        return res;
+    }();
+    static const SymbolTable table{padded.data(), uint32_t(possibleSymbols.size())};
+    return table;
+}
+
+bool mapScalar(const SymbolTable &symbols, const uint32_t *words, size_t n, char *out, uint32_t threshold) {
+    bool accepted = true;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t product = uint64_t{words[i]} * symbols.count;
+        out[i] = symbols.table[product >> 32];
+        accepted &= uint32_t(product) >= threshold;
+    }
+    return accepted;
+}
+
+#ifdef BABYLONFS_X86
+
+// High halves of words * count; clears lanes of accepted whose low half is below threshold
+__attribute__((target("sse4.2")))
+__m128i reduceSse(__m128i words, __m128i factor, __m128i &accepted, __m128i threshold) {
+    __m128i even = _mm_mul_epu32(words, factor);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(words, 32), factor);
+    __m128i low = _mm_mullo_epi32(words, factor);
+    accepted = _mm_and_si128(accepted, _mm_cmpeq_epi32(_mm_max_epu32(low, threshold), low));
+    return _mm_blend_epi16(_mm_srli_epi64(even, 32), odd, 0xCC);
+}
+
+__attribute__((target("sse4.2")))
+bool mapSse42(const SymbolTable &symbols, const uint32_t *words, size_t n, char *out, uint32_t threshold) {
+    const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(symbols.table));
+    const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(symbols.table + 16));
+    const __m128i sixteen = _mm_set1_epi8(16);
+    const __m128i factor = _mm_set1_epi32(symbols.count);
+    const __m128i bound = _mm_set1_epi32(threshold);
+    __m128i accepted = _mm_set1_epi32(-1);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        auto src = reinterpret_cast<const __m128i *>(words + i);
+        __m128i h0 = reduceSse(_mm_loadu_si128(src), factor, accepted, bound);
+        __m128i h1 = reduceSse(_mm_loadu_si128(src + 1), factor, accepted, bound);
+        __m128i h2 = reduceSse(_mm_loadu_si128(src + 2), factor, accepted, bound);
+        __m128i h3 = reduceSse(_mm_loadu_si128(src + 3), factor, accepted, bound);
+        __m128i idx = _mm_packus_epi16(_mm_packus_epi32(h0, h1), _mm_packus_epi32(h2, h3));
+        if (symbols.count <= shuffleSymbols) {
+            __m128i res = _mm_blendv_epi8(_mm_shuffle_epi8(low, idx),
+                                          _mm_shuffle_epi8(high, _mm_sub_epi8(idx, sixteen)),
+                                          _mm_cmpgt_epi8(idx, _mm_set1_epi8(15)));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), res);
+        } else {
+            alignas(16) uint8_t indices[16];
+            _mm_store_si128(reinterpret_cast<__m128i *>(indices), idx);
+            for (int j = 0; j < 16; ++j) {
+                out[i + j] = symbols.table[indices[j]];
+            }
+        }
+    }
+    return mapScalar(symbols, words + i, n - i, out + i, threshold) && _mm_movemask_epi8(accepted) == 0xFFFF;
+}
+
+__attribute__((target("avx2")))
+__m256i reduceAvx(__m256i words, __m256i factor, __m256i &accepted, __m256i threshold) {
+    __m256i even = _mm256_mul_epu32(words, factor);
+    __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(words, 32), factor);
+    __m256i low = _mm256_mullo_epi32(words, factor);
+    accepted = _mm256_and_si256(accepted, _mm256_cmpeq_epi32(_mm256_max_epu32(low, threshold), low));
+    return _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xAA);
+}
+
+__attribute__((target("avx2")))
+bool mapAvx2(const SymbolTable &symbols, const uint32_t *words, size_t n, char *out, uint32_t threshold) {
+    const __m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(symbols.table)));
+    const __m256i high = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(symbols.table + 16)));
+    const __m256i sixteen = _mm256_set1_epi8(16);
+    // packs interleave the 128-bit lanes, this restores word order
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    const __m256i factor = _mm256_set1_epi32(symbols.count);
+    const __m256i bound = _mm256_set1_epi32(threshold);
+    __m256i accepted = _mm256_set1_epi32(-1);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        auto src = reinterpret_cast<const __m256i *>(words + i);
+        __m256i h0 = reduceAvx(_mm256_loadu_si256(src), factor, accepted, bound);
+        __m256i h1 = reduceAvx(_mm256_loadu_si256(src + 1), factor, accepted, bound);
+        __m256i h2 = reduceAvx(_mm256_loadu_si256(src + 2), factor, accepted, bound);
+        __m256i h3 = reduceAvx(_mm256_loadu_si256(src + 3), factor, accepted, bound);
+        __m256i packed = _mm256_packus_epi16(_mm256_packus_epi32(h0, h1), _mm256_packus_epi32(h2, h3));
+        __m256i idx = _mm256_permutevar8x32_epi32(packed, order);
+        if (symbols.count <= shuffleSymbols) {
+            __m256i res = _mm256_blendv_epi8(_mm256_shuffle_epi8(low, idx),
+                                             _mm256_shuffle_epi8(high, _mm256_sub_epi8(idx, sixteen)),
+                                             _mm256_cmpgt_epi8(idx, _mm256_set1_epi8(15)));
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), res);
+        } else {
+            alignas(32) uint8_t indices[32];
+            _mm256_store_si256(reinterpret_cast<__m256i *>(indices), idx);
+            for (int j = 0; j < 32; ++j) {
+                out[i + j] = symbols.table[indices[j]];
+            }
+        }
+    }
+    return mapSse42(symbols, words + i, n - i, out + i, threshold) && _mm256_movemask_epi8(accepted) == -1;
+}
+
+#endif
+
+bool map(SimdLevel level, const SymbolTable &symbols, const uint32_t *words, size_t n, char *out,
+         uint32_t threshold) {
+    switch (level) {
+#ifdef BABYLONFS_X86
+        case SimdLevel::Avx2:
+            return mapAvx2(symbols, words, n, out, threshold);
+        case SimdLevel::Sse42:
+            return mapSse42(symbols, words, n, out, threshold);
+#endif
+        default:
+            return mapScalar(symbols, words, n, out, threshold);
+    }
+}
+
+SimdLevel bestLevel() {
+    static const SimdLevel level = detectSimdLevel();
+    return level;
+}
+
+}
+
+SimdLevel detectSimdLevel() {
+#ifdef BABYLONFS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return SimdLevel::Avx2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return SimdLevel::Sse42;
+    }
+#endif
+    return SimdLevel::Scalar;
+}
+
+bool mapToSymbols(SimdLevel level, const uint32_t *words, size_t n, char *out, uint32_t threshold) {
+    return map(level, standardTable(), words, n, out, threshold);
+}
+
+bool mapToSymbols(const uint32_t *words, size_t n, char *out, uint32_t threshold) {
+    return mapToSymbols(bestLevel(), words, n, out, threshold);
+}
+
+Alphabet::Alphabet(std::string_view symbols, bool raw) : table(symbols), count(symbols.size()), raw(raw) {
+    table.resize(std::max<size_t>(table.size(), shuffleSymbols));
+}
+
+const Alphabet &Alphabet::standard() {
+    static const Alphabet alphabet(possibleSymbols, false);
+    return alphabet;
+}
+
+const Alphabet &Alphabet::binary() {
+    static const Alphabet alphabet({}, true);
+    return alphabet;
+}
+
+std::optional<Alphabet> Alphabet::parse(std::string_view spec) {
+    if (spec == "binary") {
+        return binary();
+    }
+    if (spec.empty() || spec.size() > 256) {
+        return std::nullopt;
+    }
+    return Alphabet(spec, false);
+}
+
+bool Alphabet::isStandard() const {
+    return this == &standard() || (!raw && std::string_view(table.data(), count) == possibleSymbols);
+}
+
+bool Alphabet::isBinary() const {
+    return raw;
+}
+
+size_t Alphabet::wordBytes() const {
+    return raw ? sizeof(uint32_t) : 1;
+}
+
+void Alphabet::map(SimdLevel level, const uint32_t *words, size_t n, char *out) const {
+    if (raw) {
+        // words are emitted in native byte order
+        std::memcpy(out, words, n * sizeof(uint32_t));
+        return;
+    }
+    ::map(level, {table.data(), count}, words, n, out, 0);
+}
+
+void Alphabet::map(const uint32_t *words, size_t n, char *out) const {
+    map(bestLevel(), words, n, out);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+inline constexpr std::string_view possibleSymbols = "abcdefghijklmnopqrstuvwxyz.,";
+
+enum class SimdLevel {
+    Scalar,
+    Sse42,
+    Avx2,
+};
+
+// Best kernel supported by the running CPU
+SimdLevel detectSimdLevel();
+
+// Writes possibleSymbols[(words[i] * 28) >> 32] to out[i] for every word.
+// Returns false if the low half of some product is below threshold, which is
+// how Lemire's reduction detects a word it has to reject.
+bool mapToSymbols(const uint32_t *words, size_t n, char *out, uint32_t threshold = 0);
+
+bool mapToSymbols(SimdLevel level, const uint32_t *words, size_t n, char *out, uint32_t threshold = 0);
+
+// Symbols of book texts. The standard alphabet maps every random word to one
+// of possibleSymbols, custom ones to one of up to 256 arbitrary bytes with the
+// same multiply-shift reduction, and the binary one emits the four bytes of
+// every word unchanged.
+class Alphabet {
+public:
+    static const Alphabet &standard();
+    static const Alphabet &binary();
+
+    // "binary", or the symbols of a custom alphabet
+    static std::optional<Alphabet> parse(std::string_view spec);
+
+    bool isStandard() const;
+    bool isBinary() const;
+
+    // Bytes of text produced from one random word
+    size_t wordBytes() const;
+
+    // Writes the text made of n words, n * wordBytes() bytes, to out
+    void map(const uint32_t *words, size_t n, char *out) const;
+
+    void map(SimdLevel level, const uint32_t *words, size_t n, char *out) const;
+
+private:
+    Alphabet(std::string_view symbols, bool raw);
+
+    // symbols padded to at least 32 bytes for the shuffle kernels
+    std::string table;
+    uint32_t count;
+    bool raw;
+};
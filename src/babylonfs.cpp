@@ -1,11 +1,14 @@
 #include <fuse.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cstring>
 #include <utility>
 #include <system_error>
 #include <iostream>
 
 #include "babylonfs.h"
+#include "logic.h"
+#include "util.h"
 
 void throwError(std::errc code) {
     throw std::system_error{std::make_error_code(code)};
@@ -19,14 +22,29 @@ void File::write(const char *, size_t, off_t) {
     throwError(std::errc::permission_denied);
 }
 
-int File::getSize() {
+off_t File::getSize() {
     return getContents().size();
 }
 
+void File::prefetch(off_t, size_t) {}
+
+void File::readInto(char *dst, size_t size, off_t offset) {
+    std::memcpy(dst, getContents().data() + offset, size);
+}
+
 bool File::isWriteable() {
     return false;
 }
 
+std::vector<std::string> Directory::getContents() {
+    return handle().getContents();
+}
+
+Entity::ptr Directory::get(std::string_view name) {
+    auto child = handle().get(name);
+    return child ? child->entity() : nullptr;
+}
+
 void Directory::createFile(const std::string &) {
     throwError(std::errc::permission_denied);
 }
@@ -35,11 +53,6 @@ void Directory::createDirectory(const std::string &) {
     throwError(std::errc::permission_denied);
 }
 
-void Directory::stat(struct stat *st) {
-    st->st_mode = S_IFDIR | 0755;
-    st->st_nlink = 2;
-}
-
 void Directory::deleteDirectory(const std::string &) {
     throwError(std::errc::permission_denied);
 }
@@ -48,56 +61,170 @@ void Directory::deleteFile(const std::string &) {
     throwError(std::errc::permission_denied);
 }
 
-void File::stat(struct stat *st) {
-    st->st_mode = S_IFREG | 0644;
-    st->st_nlink = 1;
-    st->st_size = getSize();
+const struct fuse_operations *BabylonFS::run(const char *seed, int cycle) noexcept {
+    return run(seed, cycle, Settings{});
 }
 
-const struct fuse_operations *BabylonFS::run(const char *seed, int cycle) noexcept {
+const struct fuse_operations *BabylonFS::run(const char *seed, int cycle, const Settings &settings) noexcept {
     auto &me = instance();
     if (seed == nullptr) {
         me.seed = "";
     } else {
         me.seed = seed;
     }
+    me.libraryKey = ::libraryKey(me.seed);
     me.cycle = cycle;
+    me.engine = settings.engine;
+    me.alphabet = settings.alphabet;
+    me.geometry = settings.geometry;
+    me.inodeCodec = InodeCodec(me.geometry.bookcases, me.geometry.shelves, me.geometry.booksPerShelf);
+    auto threads = settings.threads >= 0 ? settings.threads : std::thread::hardware_concurrency();
+    // a single worker only adds hand-off latency, the caller generates alone then
+    me.poolThreads = threads > 1 ? threads : 0;
+    me.pool = std::make_unique<ThreadPool>(me.poolThreads);
+    me.poolOwner = getpid();
+    me.contentCache = std::make_unique<BlockCache>(settings.contentCache);
+    me.pathCache = std::make_unique<PathCache>(settings.pathCache);
+    me.inodes = std::make_unique<InodeTable>();
+    me.readahead = settings.readahead;
+    me.maxRooms = settings.maxRooms;
+    me.roomMemory = settings.roomMemory;
+    me.prefetchRooms = settings.prefetchRooms;
+    me.prefetchNames = settings.prefetchNames;
+    me.prewarmRooms = settings.prewarm && cycle > 0;
+    me.prewarmContent = std::clamp(settings.prewarmContent, 0, 100);
+    me.prewarmWait = settings.prewarmWait;
     return me.fuseOps.get();
 }
 
-Entity::ptr BabylonFS::getPath(const std::string& pathStr) {
-    std::filesystem::path path{pathStr};
-    Entity::ptr cur = getRoot();
-    for (const auto &element : path) {
-        if (element == "/") {
-            continue;
-        }
+const struct fuse_lowlevel_ops *BabylonFS::getLowLevelOps() noexcept {
+    return instance().lowLevelOps.get();
+}
+
+BabylonFS::Operation::Operation() {
+    instance().getRooms().beginOperation();
+}
 
-        auto *dir = dynamic_cast<Directory*>(cur.get());
-        cur = dir ? dir->get(element) : nullptr;
+BabylonFS::Operation::~Operation() {
+    instance().getRooms().endOperation();
+}
+
+EntityHandle BabylonFS::findPath(std::string_view path) {
+    auto generation = pathCache->generation();
+    auto [resolved, locator] = pathCache->find(path);
+    auto cur = locator ? resolve(*locator) : std::nullopt;
+    if (!cur) {
+        if (locator) {
+            pathCache->drop(path.substr(0, resolved));
+        }
+        resolved = 0;
+        cur = getRoot();
+    }
+    PathSplitter components(path, resolved);
+    for (auto element = components.next(); !element.empty(); element = components.next()) {
+        cur = cur->get(element);
 
         if (!cur) {
             throwError(std::errc::no_such_file_or_directory);
         }
+        if (auto at = cur->locate()) {
+            pathCache->put(path.substr(0, components.position()), *at, generation);
+        }
     }
 
-    return cur;
+    return *cur;
 }
 
-BabylonFS::BabylonFS() : fuseOps(std::make_unique<struct fuse_operations>()) {
+Entity::ptr BabylonFS::getPath(std::string_view path) {
+    return findPath(path).entity();
+}
+
+void BabylonFS::statEntity(const EntityHandle &entity, struct stat *st) {
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_atime = time(nullptr);
+    st->st_mtime = time(nullptr);
+    entity.stat(st);
+}
+
+Readahead *BabylonFS::makeReadahead(const EntityHandle &file) const {
+    // notes are never prefetched, and a window under one block never opens
+    if (!std::holds_alternative<EntityHandle::Book>(file.view) || readahead < contentBlockSize) {
+        return nullptr;
+    }
+    return new Readahead(contentBlockSize, readahead / contentBlockSize);
+}
+
+void BabylonFS::readFile(const EntityHandle &file, Readahead *readahead, char *dst, size_t size, off_t offset) {
+    file.readInto(dst, size, offset);
+    if (readahead) {
+        auto [first, last] = readahead->onRead(offset, size);
+        if (first < last) {
+            file.prefetch(first * contentBlockSize, (last - first) * contentBlockSize);
+        }
+    }
+}
+
+void BabylonFS::onInit() {
+    if (poolOwner != getpid()) {
+        // the workers were left behind in the parent, their handles are unusable here
+        pool.release();
+        pool = std::make_unique<ThreadPool>(poolThreads);
+        poolOwner = getpid();
+    }
+    if (prewarmRooms) {
+        // a mount that was never destroyed may have left its warm-up behind
+        stopPrewarm();
+        prewarmStopped = false;
+        if (prewarmWait) {
+            // requests queue up in the kernel until init returns
+            prewarm();
+        } else {
+            prewarmThread = std::thread([this] { prewarm(); });
+        }
+    }
+}
+
+void BabylonFS::onDestroy() {
+    stopPrewarm();
+    // queued readahead and room walks finish while everything they use is still there
+    pool = std::make_unique<ThreadPool>(0);
+    poolThreads = 0;
+
+    auto stats = getContentCache().stats();
+    std::cerr << "babylonfs: content cache " << stats.hits << " hits, " << stats.misses << " misses, "
+              << stats.evictions << " evictions, " << stats.rejections << " rejected, "
+              << stats.bytes << "/" << stats.capacity << " bytes" << std::endl;
+    auto flights = getBlockFlights().stats();
+    std::cerr << "babylonfs: " << flights.leaders << " blocks generated, " << flights.shared
+              << " duplicate generations avoided" << std::endl;
+    auto rooms = getRooms().stats();
+    std::cerr << "babylonfs: " << rooms.resident << " rooms in memory, " << rooms.pinned << " of them changed, "
+              << rooms.evictions << " evicted, " << rooms.prefetched << " prefetched, "
+              << rooms.prefetchSkipped << " prefetch walks skipped" << std::endl;
+    std::cerr << "babylonfs: room containers made " << rooms.arenaAllocations << " allocations from "
+              << rooms.heapAllocations << " heap chunks" << std::endl;
+    auto paths = pathCache->stats();
+    std::cerr << "babylonfs: path cache " << paths.hits << " hits, " << paths.prefixHits << " prefix hits, "
+              << paths.misses << " misses, " << paths.invalidations << " invalidations, " << paths.stale << " stale, " << paths.size
+              << " paths" << std::endl;
+}
+
+BabylonFS::BabylonFS() : fuseOps(std::make_unique<struct fuse_operations>()), lowLevelOps(makeLowLevelOps()) {
     fuseOps->init = [](struct fuse_conn_info *conn) -> void * {
         (void) conn;
+        instance().onInit();
         return nullptr;
     };
 
-    fuseOps->getattr = [](const char *path, struct stat *st) -> int {
-        st->st_uid = getuid();
-        st->st_gid = getgid();
-        st->st_atime = time(nullptr);
-        st->st_mtime = time(nullptr);
+    fuseOps->destroy = [](void *) {
+        instance().onDestroy();
+    };
 
+    fuseOps->getattr = [](const char *path, struct stat *st) -> int {
+        Operation operation;
         try {
-            instance().getPath(path)->stat(st);
+            statEntity(instance().findPath(path), st);
         } catch (std::system_error &e) {
             return -e.code().value();
         }
@@ -107,22 +234,27 @@ BabylonFS::BabylonFS() : fuseOps(std::make_unique<struct fuse_operations>()) {
 
     fuseOps->readdir = [](const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
                           struct fuse_file_info *fi) -> int {
+        Operation operation;
         (void) offset;
         (void) fi;
 
         try {
-            auto entity = instance().getPath(path);
-            auto *dir = dynamic_cast<Directory*>(entity.get());
+            auto entity = instance().findPath(path);
 
-            if (!dir) {
+            if (!entity.isDirectory()) {
                 throwError(std::errc::not_a_directory);
             }
 
+            struct Listing {
+                void *buf;
+                fuse_fill_dir_t filler;
+            } listing{buf, filler};
             filler(buf, ".", nullptr, 0);
             filler(buf, "..", nullptr, 0);
-            for (const auto &name : dir->getContents()) {
-                filler(buf, name.c_str(), nullptr, 0);
-            }
+            entity.list(&listing, [](void *context, const char *name) {
+                auto *listing = static_cast<Listing *>(context);
+                listing->filler(listing->buf, name, nullptr, 0);
+            });
         } catch (std::system_error &e) {
             return -e.code().value();
         }
@@ -131,6 +263,7 @@ BabylonFS::BabylonFS() : fuseOps(std::make_unique<struct fuse_operations>()) {
     };
 
     fuseOps->open = [](const char *path, struct fuse_file_info *fi) -> int {
+        Operation operation;
         try {
             auto entity = instance().getPath(path);
             auto* file = dynamic_cast<File*>(entity.get());
@@ -142,6 +275,8 @@ BabylonFS::BabylonFS() : fuseOps(std::make_unique<struct fuse_operations>()) {
             if ((fi->flags & O_ACCMODE) != O_RDONLY && !file->isWriteable()) {
                 throwError(std::errc::permission_denied);
             }
+
+            fi->fh = reinterpret_cast<uint64_t>(instance().makeReadahead(file->handle()));
         } catch (std::system_error &e) {
             return -e.code().value();
         }
@@ -149,21 +284,29 @@ BabylonFS::BabylonFS() : fuseOps(std::make_unique<struct fuse_operations>()) {
         return 0;
     };
 
+    fuseOps->release = [](const char *, struct fuse_file_info *fi) -> int {
+        delete reinterpret_cast<Readahead *>(fi->fh);
+        fi->fh = 0;
+        return 0;
+    };
+
     fuseOps->create = [](const char *pathStr, mode_t mode,
                          struct fuse_file_info *fi) -> int {
+        Operation operation;
         (void)mode;
         (void)fi;
 
-        std::filesystem::path path{pathStr};
+        auto [parent, name] = splitParent(pathStr);
         try {
-            auto entity = instance().getPath(path.parent_path());
+            auto entity = instance().getPath(parent);
             auto *dir = dynamic_cast<Directory*>(entity.get());
 
             if (!dir) {
                 throwError(std::errc::not_a_directory);
             }
 
-            dir->createFile(path.filename());
+            dir->createFile(std::string(name));
+            instance().pathCache->invalidate(pathStr);
         } catch (std::system_error &e) {
             return -e.code().value();
         }
@@ -172,17 +315,20 @@ BabylonFS::BabylonFS() : fuseOps(std::make_unique<struct fuse_operations>()) {
     };
 
     fuseOps->rename = [](const char *from, const char *to) -> int {
+        Operation operation;
         try {
             auto entity = instance().getPath(from);
-            std::filesystem::path target{to};
-            auto targetEntity = instance().getPath(target.parent_path());
+            auto [targetParent, targetName] = splitParent(to);
+            auto targetEntity = instance().getPath(targetParent);
             auto targetDir = dynamic_cast<Directory*>(targetEntity.get());
 
             if (!targetDir) {
                 throwError(std::errc::not_a_directory);
             }
 
-            entity->move(*targetDir, target.filename());
+            entity->move(*targetDir, std::string(targetName));
+            instance().pathCache->invalidate(from);
+            instance().pathCache->invalidate(to);
         } catch (std::system_error &e) {
             return -e.code().value();
         }
@@ -191,27 +337,19 @@ BabylonFS::BabylonFS() : fuseOps(std::make_unique<struct fuse_operations>()) {
 
 
     fuseOps->read = [](const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) -> int {
-        // removes unused fi warning
-        (void) fi;
-
+        Operation operation;
         try {
-            auto entity = instance().getPath(path);
-            auto* file = dynamic_cast<File*>(entity.get());
-
-            if (!file) {
-                throwError(std::errc::is_a_directory);
-            }
-
-            auto len = file->getSize();
+            auto file = instance().findPath(path);
+            auto len = file.getSize();
 
             if (offset < len) {
-                if (len < offset + size) {
+                if (len - offset < off_t(size)) {
                     size = len - offset;
                 }
-                std::memcpy(buf, file->getContents().data() + offset, size);
             } else {
                 size = 0;
             }
+            readFile(file, reinterpret_cast<Readahead *>(fi->fh), buf, size, offset);
         } catch (std::system_error &e) {
             return -e.code().value();
         }
@@ -221,6 +359,7 @@ BabylonFS::BabylonFS() : fuseOps(std::make_unique<struct fuse_operations>()) {
 
     fuseOps->write = [](const char *path, const char *buf, size_t size, off_t offset,
                         struct fuse_file_info *fi) -> int {
+        Operation operation;
         (void) fi;
 
         try {
@@ -240,16 +379,18 @@ BabylonFS::BabylonFS() : fuseOps(std::make_unique<struct fuse_operations>()) {
     };
 
     fuseOps->unlink = [](const char *pathStr) -> int {
+        Operation operation;
         try {
-            auto path = std::filesystem::path(pathStr);
-            auto entity = instance().getPath(path.parent_path());
+            auto [parent, name] = splitParent(pathStr);
+            auto entity = instance().getPath(parent);
             auto* dir = dynamic_cast<Directory*>(entity.get());
 
             if (!dir) {
                 throwError(std::errc::no_such_file_or_directory);
             }
 
-            dir->deleteFile(path.filename());
+            dir->deleteFile(std::string(name));
+            instance().pathCache->invalidate(pathStr);
         } catch (std::system_error &e) {
             return -e.code().value();
         }
@@ -258,16 +399,18 @@ BabylonFS::BabylonFS() : fuseOps(std::make_unique<struct fuse_operations>()) {
     };
 
     fuseOps->rmdir = [](const char *pathStr) -> int {
+        Operation operation;
         try {
-            auto path = std::filesystem::path(pathStr);
-            auto entity = instance().getPath(path.parent_path());
+            auto [parent, name] = splitParent(pathStr);
+            auto entity = instance().getPath(parent);
             auto* dir = dynamic_cast<Directory*>(entity.get());
 
             if (!dir) {
                 throwError(std::errc::no_such_file_or_directory);
             }
 
-            dir->deleteDirectory(path.filename());
+            dir->deleteDirectory(std::string(name));
+            instance().pathCache->invalidate(pathStr);
         } catch (std::system_error &e) {
             return -e.code().value();
         }
@@ -276,12 +419,11 @@ BabylonFS::BabylonFS() : fuseOps(std::make_unique<struct fuse_operations>()) {
     };
 
     fuseOps->mkdir = [](const char *pathStr, mode_t mode) -> int {
+        Operation operation;
         (void)mode;
 
         try {
-            auto path = std::filesystem::path(pathStr);
-            auto parent = path.parent_path();
-            auto name = path.filename();
+            auto [parent, name] = splitParent(pathStr);
             auto entity = instance().getPath(parent);
             auto* dir = dynamic_cast<Directory*>(entity.get());
 
@@ -289,7 +431,8 @@ BabylonFS::BabylonFS() : fuseOps(std::make_unique<struct fuse_operations>()) {
                 throwError(std::errc::not_a_directory);
             }
 
-            dir->createDirectory(name);
+            dir->createDirectory(std::string(name));
+            instance().pathCache->invalidate(pathStr);
 
             return 0;
         } catch (std::system_error &e) {
@@ -298,11 +441,46 @@ BabylonFS::BabylonFS() : fuseOps(std::make_unique<struct fuse_operations>()) {
     };
 }
 
+BabylonFS::BabylonFS(int cycle) : cycle(cycle) {}
+
 BabylonFS &BabylonFS::instance() noexcept {
     static BabylonFS singleton;
     return singleton;
 }
 
-std::string BabylonFS::getSeed() noexcept {
+const std::string &BabylonFS::getSeed() noexcept {
     return instance().seed;
 }
+
+const Key128 &BabylonFS::getLibraryKey() noexcept {
+    return instance().libraryKey;
+}
+
+const ContentEngine &BabylonFS::getEngine() noexcept {
+    return *instance().engine;
+}
+
+const Alphabet &BabylonFS::getAlphabet() noexcept {
+    return instance().alphabet;
+}
+
+const BabylonFS::Geometry &BabylonFS::getGeometry() noexcept {
+    return instance().geometry;
+}
+
+const InodeCodec &BabylonFS::getInodeCodec() noexcept {
+    return instance().inodeCodec;
+}
+
+ThreadPool &BabylonFS::getPool() noexcept {
+    return *instance().pool;
+}
+
+BlockCache &BabylonFS::getContentCache() noexcept {
+    return *instance().contentCache;
+}
+
+
+BabylonFS::BlockFlights &BabylonFS::getBlockFlights() noexcept {
+    return instance().blockFlights;
+}
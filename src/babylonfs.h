@@ -2,33 +2,50 @@
 
 #include <string>
 #include <memory>
+#include <memory_resource>
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include <filesystem>
 #include <vector>
 #include <unordered_map>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 
-using NoteContent = std::pair<std::string, std::string>;
+#include "alphabet.h"
+#include "cache.h"
+#include "engine.h"
+#include "handle.h"
+#include "inodes.h"
+#include "pathcache.h"
+#include "readahead.h"
+#include "singleflight.h"
+#include "threadpool.h"
+
+using NoteContent = std::pair<std::pmr::string, std::pmr::string>;
+
+struct RoomStorage;
 
 [[noreturn]] void throwError(std::errc code);
 
 struct Entity {
     using ptr = std::unique_ptr<Entity>;
 
-    virtual void stat(struct stat *) = 0;
-
     virtual void move(Entity &to, const std::string& newName);
 
+    // View of the entity used by lookups, stat, read and readdir
+    virtual EntityHandle handle() const = 0;
+
     virtual ~Entity() = default;
 
     std::string name;
 };
 
 struct Directory : public Entity {
-    void stat(struct stat *) override;
-
-    virtual std::vector<std::string> getContents() = 0;
+    std::vector<std::string> getContents();
 
-    virtual Entity::ptr get(const std::string &name) = 0;
+    // Child with this name, nullptr if there is none
+    Entity::ptr get(std::string_view name);
 
     virtual void createFile(const std::string& name);
 
@@ -40,11 +57,15 @@ struct Directory : public Entity {
 };
 
 struct File : public Entity {
-    void stat(struct stat *) override;
-
     virtual std::string_view getContents() = 0;
 
-    virtual int getSize();
+    // Copies [offset, offset + size) to dst, the range must lie within the file
+    virtual void readInto(char *dst, size_t size, off_t offset);
+
+    virtual off_t getSize();
+
+    // Hint that [offset, offset + size) will be read soon
+    virtual void prefetch(off_t offset, size_t size);
 
     virtual bool isWriteable();
 
@@ -54,22 +75,143 @@ struct File : public Entity {
 
 class BabylonFS {
 public:
+    using BlockFlights = SingleFlight<BlockId, BlockCache::Block, BlockIdHash>;
+
+    struct Geometry {
+        int bookcases = 4;
+        int shelves = 5;
+        int booksPerShelf = 32;
+        uint64_t bookSize = 4096 * 256;
+    };
+
+    struct Settings {
+        const ContentEngine *engine = &ContentEngine::getDefault();
+        // symbols of book texts, other than the standard one needs an engine that supports alphabets
+        Alphabet alphabet = Alphabet::standard();
+        Geometry geometry;
+        // workers generating large reads, -1 means one per core
+        int threads = -1;
+        // byte budget of the generated block cache
+        size_t contentCache = 64 << 20;
+        // largest window generated ahead of sequential reads
+        size_t readahead = 2 << 20;
+        // resolved paths kept, 0 resolves every path from the root
+        size_t pathCache = 64 * 1024;
+        // limits on rooms kept in memory, 0 means unlimited; rooms without
+        // user changes are evicted beyond them and regenerated when visited
+        size_t maxRooms = 0;
+        size_t roomMemory = 0;
+        // rooms up to this many links ahead of a walk are prepared in the background
+        int prefetchRooms = 0;
+        // also generate the book names of those rooms
+        bool prefetchNames = false;
+        // with a cycle, build every room's book names on mount
+        bool prewarm = false;
+        // percentage of books whose text is generated into the cache on prewarm
+        int prewarmContent = 0;
+        // serve requests only once prewarm is finished instead of warming in the background
+        bool prewarmWait = false;
+    };
+
     static const struct fuse_operations *run(const char *seed, int cycle) noexcept;
-    static std::string getSeed() noexcept;
+    static const struct fuse_operations *run(const char *seed, int cycle, const Settings &settings) noexcept;
+    // Inode based frontend to the library set up by run(), an alternative to the operations it returns
+    static const struct fuse_lowlevel_ops *getLowLevelOps() noexcept;
+    static const std::string &getSeed() noexcept;
+    static const Key128 &getLibraryKey() noexcept;
+    static const ContentEngine &getEngine() noexcept;
+    static const Alphabet &getAlphabet() noexcept;
+    static const Geometry &getGeometry() noexcept;
+    static const InodeCodec &getInodeCodec() noexcept;
+    static ThreadPool &getPool() noexcept;
+    static BlockCache &getContentCache() noexcept;
+    static BlockFlights &getBlockFlights() noexcept;
 
 private:
     BabylonFS();
 
-    BabylonFS(int cycle) : cycle(cycle) {};
+    BabylonFS(int cycle);
+
+    ~BabylonFS();
 
     static BabylonFS &instance() noexcept;
 
-    Entity::ptr getRoot();
+    static std::unique_ptr<struct fuse_lowlevel_ops> makeLowLevelOps();
+
+    // Marks a FUSE call in progress, the rooms it reaches are not evicted before it returns
+    struct Operation {
+        Operation();
+        ~Operation();
+    };
+
+    RoomStorage &getRooms();
+
+    EntityHandle getRoot();
+
+    // The entity a cached path points to, nullopt if it is not there any more
+    std::optional<EntityHandle> resolve(const Locator &locator);
+
+    // Generates name tables of all rooms and the configured share of books
+    void prewarm();
+    // Makes a background prewarm give up and waits for it
+    void stopPrewarm();
+
+    // Walks the path, throws ENOENT if it leads nowhere
+    EntityHandle findPath(std::string_view path);
+    Entity::ptr getPath(std::string_view path);
+
+    // The entity with this inode wherever it is now, nullopt if it is gone
+    std::optional<EntityHandle> resolveInode(uint64_t ino);
+
+    // Entity behind a node id handed out by the low-level frontend
+    EntityHandle findInode(uint64_t id);
+    Entity::ptr getInode(uint64_t id);
+
+    // Entry of a child found by lookup, counted as one more lookup of a directory node
+    struct fuse_entry_param makeEntry(uint64_t parent, std::string_view name, const EntityHandle &entity);
+
+    static void statEntity(const EntityHandle &entity, struct stat *st);
+
+    // Read pattern tracker for an open file, nullptr where nothing would be prefetched
+    Readahead *makeReadahead(const EntityHandle &file) const;
+
+    // Copies [offset, offset + size) within the file and prefetches what the reads lead to
+    static void readFile(const EntityHandle &file, Readahead *readahead, char *dst, size_t size, off_t offset);
 
-    Entity::ptr getPath(const std::string& pathStr);
+    // Shared by both frontends: init starts the background work, destroy reports the statistics
+    void onInit();
+    void onDestroy();
 
 private:
     std::unique_ptr<struct fuse_operations> fuseOps{};
+    std::unique_ptr<struct fuse_lowlevel_ops> lowLevelOps{};
     std::string seed;
+    Key128 libraryKey = ::libraryKey("");
     int cycle = -1;
+    const ContentEngine *engine = &ContentEngine::getDefault();
+    Alphabet alphabet = Alphabet::standard();
+    Geometry geometry;
+    InodeCodec inodeCodec{geometry.bookcases, geometry.shelves, geometry.booksPerShelf};
+    std::unique_ptr<BlockCache> contentCache;
+    BlockFlights blockFlights;
+    std::unique_ptr<PathCache> pathCache;
+    std::unique_ptr<InodeTable> inodes;
+    // made by the first getRooms() with the settings of that time
+    std::once_flag roomsCreated;
+    std::unique_ptr<RoomStorage> rooms;
+    // declared after everything its tasks use, so it is joined before they go
+    std::unique_ptr<ThreadPool> pool;
+    size_t poolThreads = 0;
+    // process that started the pool, fuse_main may fork into the background afterwards
+    pid_t poolOwner = 0;
+    size_t readahead = 0;
+    size_t maxRooms = 0;
+    size_t roomMemory = 0;
+    int prefetchRooms = 0;
+    bool prefetchNames = false;
+    bool prewarmRooms = false;
+    int prewarmContent = 0;
+    bool prewarmWait = false;
+    std::thread prewarmThread;
+    std::atomic<bool> prewarmStopped{false};
 };
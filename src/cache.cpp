@@ -0,0 +1,159 @@
+#include "cache.h"
+
+#include <algorithm>
+#include <bit>
+
+size_t BlockIdHash::operator()(const BlockId &id) const noexcept {
+    auto key = childKey(id.book, id.index);
+    return key.lo ^ mix64(reinterpret_cast<uintptr_t>(id.engine));
+}
+
+BlockCache::FrequencySketch::FrequencySketch(size_t expectedEntries) {
+    size_t width = std::bit_ceil(std::max<size_t>(expectedEntries, 16));
+    counters.assign(4 * width, 0);
+    mask = width - 1;
+    // counters are halved every sampleSize increments so old popularity fades
+    sampleSize = 10 * std::max<size_t>(expectedEntries, 16);
+}
+
+size_t BlockCache::FrequencySketch::slot(uint64_t hash, int row) const {
+    return row * (mask + 1) + (mix64(hash + row * 0x9e3779b97f4a7c15ULL) & mask);
+}
+
+void BlockCache::FrequencySketch::increment(uint64_t hash) {
+    for (int row = 0; row < 4; ++row) {
+        auto &counter = counters[slot(hash, row)];
+        counter = std::min(counter + 1, 15);
+    }
+    if (++additions == sampleSize) {
+        for (auto &counter : counters) {
+            counter /= 2;
+        }
+        additions /= 2;
+    }
+}
+
+int BlockCache::FrequencySketch::estimate(uint64_t hash) const {
+    int result = 15;
+    for (int row = 0; row < 4; ++row) {
+        result = std::min<int>(result, counters[slot(hash, row)]);
+    }
+    return result;
+}
+
+BlockCache::BlockCache(size_t capacity) :
+        capacity(capacity),
+        windowCapacity(capacity / 100),
+        protectedCapacity((capacity - capacity / 100) * 4 / 5),
+        sketch(capacity / contentBlockSize) {}
+
+size_t BlockCache::getCapacity() const {
+    return capacity;
+}
+
+BlockCache::List &BlockCache::list(Segment segment) {
+    switch (segment) {
+        case Segment::Window:
+            return window;
+        case Segment::Probation:
+            return probation;
+        default:
+            return protectedList;
+    }
+}
+
+size_t &BlockCache::bytes(Segment segment) {
+    switch (segment) {
+        case Segment::Window:
+            return windowBytes;
+        case Segment::Probation:
+            return probationBytes;
+        default:
+            return protectedBytes;
+    }
+}
+
+void BlockCache::moveTo(List::iterator it, Segment segment) {
+    bytes(it->segment) -= it->block->size();
+    bytes(segment) += it->block->size();
+    list(segment).splice(list(segment).begin(), list(it->segment), it);
+    it->segment = segment;
+}
+
+void BlockCache::drop(List::iterator it) {
+    bytes(it->segment) -= it->block->size();
+    index.erase(it->id);
+    list(it->segment).erase(it);
+}
+
+void BlockCache::evict(List::iterator it) {
+    drop(it);
+    ++evictions;
+}
+
+BlockCache::Block BlockCache::get(const BlockId &id) {
+    std::lock_guard lock(mutex);
+    auto hash = BlockIdHash{}(id);
+    sketch.increment(hash);
+
+    auto found = index.find(id);
+    if (found == index.end()) {
+        ++misses;
+        return nullptr;
+    }
+    ++hits;
+    auto it = found->second;
+    if (it->segment == Segment::Window) {
+        moveTo(it, Segment::Window);
+    } else {
+        // a second hit promotes a probation block, the protected LRU falls back to probation
+        moveTo(it, Segment::Protected);
+        while (protectedBytes > protectedCapacity && protectedList.size() > 1) {
+            moveTo(std::prev(protectedList.end()), Segment::Probation);
+        }
+    }
+    return it->block;
+}
+
+bool BlockCache::contains(const BlockId &id) const {
+    std::lock_guard lock(mutex);
+    return index.contains(id);
+}
+
+void BlockCache::put(const BlockId &id, Block block) {
+    if (block->size() > capacity) {
+        return;
+    }
+    std::lock_guard lock(mutex);
+    if (index.contains(id)) {
+        return;
+    }
+    window.push_front({id, std::move(block), Segment::Window});
+    windowBytes += window.front().block->size();
+    index[id] = window.begin();
+    while (windowBytes > windowCapacity && !window.empty()) {
+        admitFromWindow();
+    }
+}
+
+void BlockCache::admitFromWindow() {
+    auto candidate = std::prev(window.end());
+    int candidateFrequency = sketch.estimate(BlockIdHash{}(candidate->id));
+    while (windowBytes + probationBytes + protectedBytes > capacity && !(probation.empty() && protectedList.empty())) {
+        // the main segment is full, the candidate has to beat its LRU victim
+        auto &victims = probation.empty() ? protectedList : probation;
+        auto victim = std::prev(victims.end());
+        if (sketch.estimate(BlockIdHash{}(victim->id)) >= candidateFrequency) {
+            ++rejections;
+            drop(candidate);
+            return;
+        }
+        evict(victim);
+    }
+    moveTo(candidate, Segment::Probation);
+}
+
+BlockCache::Stats BlockCache::stats() const {
+    std::lock_guard lock(mutex);
+    return {hits, misses, evictions, rejections, windowBytes + probationBytes + protectedBytes, capacity};
+}
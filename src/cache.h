@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "keys.h"
+
+class ContentEngine;
+
+// Book texts are cached in blocks of this many bytes
+static const uint64_t contentBlockSize = 64 * 1024;
+
+struct BlockId {
+    const ContentEngine *engine;
+    Key128 book;
+    uint64_t index;
+
+    bool operator==(const BlockId &) const = default;
+};
+
+struct BlockIdHash {
+    size_t operator()(const BlockId &id) const noexcept;
+};
+
+// Process-wide cache of generated blocks bounded by a byte budget. Admission
+// and eviction follow W-TinyLFU: new blocks enter a small LRU window and only
+// replace a block of the main segmented LRU if a frequency sketch says they
+// are requested more often, so one long scan cannot flush the hot set.
+class BlockCache {
+public:
+    using Block = std::shared_ptr<const std::string>;
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        uint64_t rejections;
+        size_t bytes;
+        size_t capacity;
+    };
+
+    explicit BlockCache(size_t capacity);
+
+    size_t getCapacity() const;
+
+    // Returns nullptr on a miss
+    Block get(const BlockId &id);
+
+    // Lookup that neither counts as an access nor updates recency
+    bool contains(const BlockId &id) const;
+
+    void put(const BlockId &id, Block block);
+
+    Stats stats() const;
+
+private:
+    enum class Segment {
+        Window,
+        Probation,
+        Protected,
+    };
+
+    struct Entry {
+        BlockId id;
+        Block block;
+        Segment segment;
+    };
+
+    using List = std::list<Entry>;
+
+    // Count-min sketch of 4 rows with saturating 4-bit counters (kept in bytes)
+    class FrequencySketch {
+    public:
+        explicit FrequencySketch(size_t expectedEntries);
+        void increment(uint64_t hash);
+        int estimate(uint64_t hash) const;
+
+    private:
+        size_t slot(uint64_t hash, int row) const;
+
+        std::vector<uint8_t> counters;
+        size_t mask;
+        size_t additions = 0;
+        size_t sampleSize;
+    };
+
+    List &list(Segment segment);
+    size_t &bytes(Segment segment);
+    void moveTo(List::iterator it, Segment segment);
+    void drop(List::iterator it);
+    void evict(List::iterator it);
+    void admitFromWindow();
+
+    const size_t capacity;
+    const size_t windowCapacity;
+    const size_t protectedCapacity;
+
+    mutable std::mutex mutex;
+    FrequencySketch sketch;
+    List window, probation, protectedList;
+    size_t windowBytes = 0, probationBytes = 0, protectedBytes = 0;
+    std::unordered_map<BlockId, List::iterator, BlockIdHash> index;
+
+    std::atomic<uint64_t> hits{0}, misses{0}, evictions{0}, rejections{0};
+};
@@ -0,0 +1,536 @@
+#include "engine.h"
+#include "aes.h"
+#include "alphabet.h"
+#include "keys.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <unordered_map>
+
+// the legacy generator stores its state every legacyCheckpointInterval symbols
+static const uint64_t legacyCheckpointInterval = 64 * 1024;
+static const size_t legacyCheckpointBooks = 32;
+// a book past this many checkpoints keeps only every other one, about 640 KiB of states per book
+static const size_t legacyCheckpointsPerBook = 256;
+
+std::string ContentEngine::generate(const std::string &seed, size_t len) const {
+    std::string res(len, '\0');
+    generate(seed, 0, res.data(), res.size());
+    return res;
+}
+
+std::string ContentEngine::generate(const Key128 &key, size_t len) const {
+    std::string res(len, '\0');
+    generate(key, 0, res.data(), res.size());
+    return res;
+}
+
+void ContentEngine::generate(const std::string &seed, uint64_t offset, char *dst, size_t len) const {
+    generate(stableHash128(seed), offset, dst, len);
+}
+
+bool ContentEngine::usesSeedString() const {
+    return false;
+}
+
+bool ContentEngine::isRandomAccess() const {
+    return true;
+}
+
+void ContentEngine::generate(const Key128 &key, uint64_t offset, char *dst, size_t len, const Alphabet &) const {
+    generate(key, offset, dst, len);
+}
+
+bool ContentEngine::supportsAlphabets() const {
+    return false;
+}
+
+void ContentEngine::generate(ThreadPool &pool, const Key128 &key, uint64_t offset, char *dst, size_t len) const {
+    generate(pool, key, offset, dst, len, Alphabet::standard());
+}
+
+void ContentEngine::generate(ThreadPool &pool, const Key128 &key, uint64_t offset, char *dst, size_t len,
+                             const Alphabet &alphabet) const {
+    if (pool.size() == 0 || len <= parallelBlockSize || !isRandomAccess()) {
+        generate(key, offset, dst, len, alphabet);
+        return;
+    }
+    // blocks are aligned to absolute offsets, so the split never depends on the pool size
+    uint64_t first = offset / parallelBlockSize;
+    uint64_t last = (offset + len - 1) / parallelBlockSize;
+    pool.parallelFor(last - first + 1, [&](size_t i) {
+        uint64_t from = std::max(offset, (first + i) * parallelBlockSize);
+        uint64_t to = std::min(offset + len, (first + i + 1) * parallelBlockSize);
+        generate(key, from, dst + (from - offset), to - from, alphabet);
+    });
+}
+
+namespace {
+
+#if defined(__GLIBCXX__)
+
+// Maps raw mt19937 words to symbols exactly like libstdc++'s
+// uniform_int_distribution<int>(0, 27) does, dropping the words it rejects.
+// Returns the number of symbols written.
+size_t mapLegacySymbols(const uint32_t *words, size_t n, char *out) {
+    const uint32_t range = possibleSymbols.size();
+    size_t count = 0;
+#if _GLIBCXX_RELEASE >= 11
+    // Lemire's nearly divisionless reduction, a batch rarely contains a rejected word
+    const uint32_t threshold = -range % range;
+    if (mapToSymbols(words, n, out, threshold)) {
+        return n;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t product = uint64_t{words[i]} * range;
+        out[count] = possibleSymbols[product >> 32];
+        count += uint32_t(product) >= threshold;
+    }
+#else
+    // division-based downscaling of older releases
+    const uint32_t scaling = UINT32_MAX / range;
+    const uint32_t past = range * scaling;
+    for (size_t i = 0; i < n; ++i) {
+        out[count] = possibleSymbols[std::min(words[i] / scaling, range - 1)];
+        count += words[i] < past;
+    }
+#endif
+    return count;
+}
+
+// Bit-compatible std::mt19937 with 32-bit state words that tempers its output in bulk
+class Mt19937 {
+public:
+    void seed(uint32_t value) {
+        state[0] = value;
+        for (uint32_t i = 1; i < n; ++i) {
+            state[i] = 1812433253u * (state[i - 1] ^ (state[i - 1] >> 30)) + i;
+        }
+        index = n;
+    }
+
+    void fill(uint32_t *out, size_t count) {
+        while (count > 0) {
+            if (index == n) {
+                twist();
+            }
+            size_t chunk = std::min<size_t>(count, n - index);
+            for (size_t i = 0; i < chunk; ++i) {
+                uint32_t y = state[index + i];
+                y ^= y >> 11;
+                y ^= (y << 7) & 0x9d2c5680u;
+                y ^= (y << 15) & 0xefc60000u;
+                y ^= y >> 18;
+                out[i] = y;
+            }
+            index += chunk;
+            out += chunk;
+            count -= chunk;
+        }
+    }
+
+private:
+    static const uint32_t n = 624;
+    static const uint32_t m = 397;
+
+    void twist() {
+        auto mix = [this](uint32_t i, uint32_t next, uint32_t shifted) {
+            uint32_t y = (state[i] & 0x80000000u) | (state[next] & 0x7fffffffu);
+            state[i] = state[shifted] ^ (y >> 1) ^ ((y & 1) ? 0x9908b0dfu : 0);
+        };
+        uint32_t i = 0;
+        for (; i < n - m; ++i) {
+            mix(i, i + 1, i + m);
+        }
+        for (; i < n - 1; ++i) {
+            mix(i, i + 1, i + m - n);
+        }
+        mix(n - 1, 0, m - 1);
+        index = 0;
+    }
+
+    std::array<uint32_t, n> state;
+    uint32_t index = n;
+};
+
+struct LegacyCheckpoint {
+    uint64_t position;
+    Mt19937 rng;
+};
+
+// Generator states of recently read books, so that a read at any offset
+// replays at most legacyCheckpointInterval symbols (plus one batch) times the
+// stride of the book, which doubles whenever its checkpoints are thinned
+class LegacyCheckpoints {
+public:
+    std::optional<LegacyCheckpoint> find(uint64_t id, uint64_t offset) {
+        std::lock_guard lock(mutex);
+        auto it = index.find(id);
+        if (it == index.end()) {
+            return std::nullopt;
+        }
+        books.splice(books.begin(), books, it->second);
+        auto &checkpoints = it->second->checkpoints;
+        auto next = std::upper_bound(checkpoints.begin(), checkpoints.end(), offset,
+                                     [](uint64_t pos, const LegacyCheckpoint &cp) { return pos < cp.position; });
+        if (next == checkpoints.begin()) {
+            return std::nullopt;
+        }
+        return *std::prev(next);
+    }
+
+    void record(uint64_t id, std::vector<LegacyCheckpoint> fresh) {
+        if (fresh.empty()) {
+            return;
+        }
+        std::lock_guard lock(mutex);
+        auto it = index.find(id);
+        if (it == index.end()) {
+            books.push_front({id});
+            it = index.emplace(id, books.begin()).first;
+        }
+        auto &book = *it->second;
+        for (auto &cp : fresh) {
+            bool onStride = cp.position / legacyCheckpointInterval % book.stride == 0;
+            if (onStride && (book.checkpoints.empty() || cp.position > book.checkpoints.back().position)) {
+                book.checkpoints.push_back(std::move(cp));
+            }
+            if (book.checkpoints.size() > legacyCheckpointsPerBook) {
+                book.stride *= 2;
+                std::erase_if(book.checkpoints, [&](const LegacyCheckpoint &kept) {
+                    return kept.position / legacyCheckpointInterval % book.stride != 0;
+                });
+            }
+        }
+        if (books.size() > legacyCheckpointBooks) {
+            index.erase(books.back().id);
+            books.pop_back();
+        }
+    }
+
+    size_t memory() {
+        std::lock_guard lock(mutex);
+        size_t bytes = 0;
+        for (const auto &book : books) {
+            bytes += book.checkpoints.size() * sizeof(LegacyCheckpoint);
+        }
+        return bytes;
+    }
+
+private:
+    struct Book {
+        uint64_t id;
+        // only checkpoints at multiples of this many intervals are kept
+        uint64_t stride = 1;
+        std::vector<LegacyCheckpoint> checkpoints;
+    };
+
+    std::mutex mutex;
+    std::list<Book> books;
+    std::unordered_map<uint64_t, std::list<Book>::iterator> index;
+};
+
+LegacyCheckpoints legacyCheckpoints;
+
+// Checkpoints are shared by all reads with the same id
+void generateLegacyRange(uint32_t rngSeed, uint64_t id, uint64_t offset, char *dst, size_t len) {
+    static const size_t batch = 512;
+
+    Mt19937 rng;
+    uint64_t pos = 0;
+    std::optional<LegacyCheckpoint> checkpoint;
+    if (offset >= legacyCheckpointInterval) {
+        checkpoint = legacyCheckpoints.find(id, offset);
+    }
+    if (checkpoint) {
+        rng = checkpoint->rng;
+        pos = checkpoint->position;
+    } else {
+        rng.seed(rngSeed);
+    }
+
+    // checkpoints are taken at batch boundaries, so their positions are not aligned
+    std::vector<LegacyCheckpoint> fresh;
+    uint64_t nextCheckpoint = (pos / legacyCheckpointInterval + 1) * legacyCheckpointInterval;
+    uint64_t end = offset + len;
+    std::array<uint32_t, batch> words;
+    std::array<char, batch> symbols;
+    while (pos < end) {
+        if (pos >= nextCheckpoint) {
+            fresh.push_back({pos, rng});
+            nextCheckpoint = (pos / legacyCheckpointInterval + 1) * legacyCheckpointInterval;
+        }
+        rng.fill(words.data(), words.size());
+        size_t count = mapLegacySymbols(words.data(), words.size(), symbols.data());
+        uint64_t from = std::max(pos, offset);
+        uint64_t to = std::min(pos + count, end);
+        if (from < to) {
+            std::copy(symbols.begin() + (from - pos), symbols.begin() + (to - pos), dst + (from - offset));
+        }
+        pos += count;
+    }
+    legacyCheckpoints.record(id, std::move(fresh));
+}
+
+size_t legacyCheckpointBytes() {
+    return legacyCheckpoints.memory();
+}
+
+#else
+
+// Other standard libraries map integers differently, replay the reference algorithm
+void generateLegacyRange(uint32_t rngSeed, uint64_t, uint64_t offset, char *dst, size_t len) {
+    std::mt19937 rng(rngSeed);
+    for (uint64_t i = 0; i < offset + len; ++i) {
+        char c = possibleSymbols[std::uniform_int_distribution<int>(0, (int)possibleSymbols.size() - 1)(rng)];
+        if (i >= offset) {
+            dst[i - offset] = c;
+        }
+    }
+}
+
+size_t legacyCheckpointBytes() {
+    return 0;
+}
+
+#endif
+
+class LegacyMt19937Engine : public ContentEngine {
+public:
+    std::string_view name() const override {
+        return "legacy-mt19937";
+    }
+
+    bool usesSeedString() const override {
+        return true;
+    }
+
+    bool isRandomAccess() const override {
+        return false;
+    }
+
+    void generate(const std::string &seed, uint64_t offset, char *dst, size_t len) const override {
+        // std::mt19937::seed keeps the low 32 bits of the hash
+        generateLegacyRange(std::hash<std::string>{}(seed), stableHash(seed), offset, dst, len);
+    }
+
+    void generate(const Key128 &key, uint64_t offset, char *dst, size_t len) const override {
+        generateLegacyRange(key.lo, key.hi, offset, dst, len);
+    }
+};
+
+// Engines whose word i is a function of the key and i only. Each word
+// becomes one symbol via multiply-shift range reduction, whose bias is below
+// 2^-27 per symbol, or four bytes of a binary text.
+class WordEngine : public ContentEngine {
+public:
+    using ContentEngine::generate;
+
+    void generate(const Key128 &key, uint64_t offset, char *dst, size_t len) const override {
+        generate(key, offset, dst, len, Alphabet::standard());
+    }
+
+    void generate(const Key128 &key, uint64_t offset, char *dst, size_t len, const Alphabet &alphabet) const override {
+        static const size_t batch = 4096;
+
+        // positions count words, a word makes width bytes of text
+        uint64_t width = alphabet.wordBytes();
+        uint64_t step = alignment();
+        uint64_t end = offset + len;
+        uint64_t endWord = (end + width - 1) / width;
+        uint64_t pos = offset / width / step * step;
+        std::array<uint32_t, batch> words;
+        std::array<char, batch * sizeof(uint32_t)> symbols;
+        while (pos < endWord) {
+            size_t count = std::min<uint64_t>(batch, (endWord - pos + step - 1) / step * step);
+            fillWords(key, pos, words.data(), count);
+            alphabet.map(words.data(), count, symbols.data());
+            uint64_t from = std::max(pos * width, offset);
+            uint64_t to = std::min((pos + count) * width, end);
+            std::copy(symbols.begin() + (from - pos * width), symbols.begin() + (to - pos * width),
+                      dst + (from - offset));
+            pos += count;
+        }
+    }
+
+    bool supportsAlphabets() const override {
+        return true;
+    }
+
+protected:
+    // Words are produced in groups of alignment(), which divides 4096
+    virtual uint64_t alignment() const = 0;
+
+    // Writes words [index, index + n) for aligned index and n
+    virtual void fillWords(const Key128 &key, uint64_t index, uint32_t *words, size_t n) const = 0;
+};
+
+using PhiloxBlock = std::array<uint32_t, 4>;
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3")
+PhiloxBlock philox(PhiloxBlock ctr, uint64_t key) {
+    uint32_t k0 = key;
+    uint32_t k1 = key >> 32;
+    for (int round = 0; round < 10; ++round) {
+        uint64_t p0 = uint64_t{0xD2511F53} * ctr[0];
+        uint64_t p1 = uint64_t{0xCD9E8D57} * ctr[2];
+        ctr = {
+            uint32_t(p1 >> 32) ^ ctr[1] ^ k0,
+            uint32_t(p1),
+            uint32_t(p0 >> 32) ^ ctr[3] ^ k1,
+            uint32_t(p0),
+        };
+        k0 += 0x9E3779B9;
+        k1 += 0xBB67AE85;
+    }
+    return ctr;
+}
+
+class PhiloxEngine : public WordEngine {
+public:
+    std::string_view name() const override {
+        return "philox";
+    }
+
+protected:
+    uint64_t alignment() const override {
+        return 4;
+    }
+
+    void fillWords(const Key128 &key, uint64_t index, uint32_t *words, size_t n) const override {
+        for (size_t i = 0; i < n; i += 4) {
+            uint64_t counter = (index + i) / 4;
+            auto block = philox({uint32_t(counter), uint32_t(counter >> 32), 0, 0}, key.lo);
+            std::copy(block.begin(), block.end(), words + i);
+        }
+    }
+};
+
+uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// SplitMix64 is a counter hashed by a strong finalizer, word pairs come from key + i * gamma
+class SplitMix64Engine : public WordEngine {
+public:
+    std::string_view name() const override {
+        return "splitmix64";
+    }
+
+protected:
+    uint64_t alignment() const override {
+        return 2;
+    }
+
+    void fillWords(const Key128 &key, uint64_t index, uint32_t *words, size_t n) const override {
+        for (size_t i = 0; i < n; i += 2) {
+            uint64_t value = splitmix64(key.lo + (index + i) / 2 * 0x9e3779b97f4a7c15ULL);
+            words[i] = value;
+            words[i + 1] = value >> 32;
+        }
+    }
+};
+
+// xoshiro256** is sequential, so every block of 4096 words runs its own
+// generator seeded from the key and the block index
+class Xoshiro256Engine : public WordEngine {
+public:
+    std::string_view name() const override {
+        return "xoshiro256";
+    }
+
+protected:
+    static const uint64_t blockWords = 4096;
+
+    uint64_t alignment() const override {
+        return blockWords;
+    }
+
+    void fillWords(const Key128 &key, uint64_t index, uint32_t *words, size_t n) const override {
+        for (size_t block = 0; block < n; block += blockWords) {
+            uint64_t x = key.lo ^ splitmix64((index + block) / blockWords);
+            std::array<uint64_t, 4> s;
+            for (auto &word : s) {
+                word = x = splitmix64(x);
+            }
+            for (size_t i = block; i < block + blockWords; i += 2) {
+                uint64_t value = std::rotl(s[1] * 5, 7) * 9;
+                uint64_t t = s[1] << 17;
+                s[2] ^= s[0];
+                s[3] ^= s[1];
+                s[1] ^= s[2];
+                s[0] ^= s[3];
+                s[2] ^= t;
+                s[3] = std::rotl(s[3], 45);
+                words[i] = value;
+                words[i + 1] = value >> 32;
+            }
+        }
+    }
+};
+
+// AES-128-CTR keyed by the full 128-bit key, every block yields four words
+class AesCtrEngine : public WordEngine {
+public:
+    std::string_view name() const override {
+        return "aes-ctr";
+    }
+
+protected:
+    uint64_t alignment() const override {
+        return 4;
+    }
+
+    void fillWords(const Key128 &key, uint64_t index, uint32_t *words, size_t n) const override {
+        Aes128::Key bytes;
+        for (int i = 0; i < 8; ++i) {
+            bytes[i] = key.lo >> (8 * i);
+            bytes[8 + i] = key.hi >> (8 * i);
+        }
+        // words are read from the keystream in native byte order
+        Aes128(bytes).ctr(index / 4, n / 4, reinterpret_cast<uint8_t *>(words));
+    }
+};
+
+const LegacyMt19937Engine legacyMt19937Engine;
+const PhiloxEngine philoxEngine;
+const SplitMix64Engine splitMix64Engine;
+const Xoshiro256Engine xoshiro256Engine;
+const AesCtrEngine aesCtrEngine;
+
+}
+
+const std::vector<const ContentEngine *> &ContentEngine::all() {
+    static const std::vector<const ContentEngine *> engines = {
+            &legacyMt19937Engine, &xoshiro256Engine, &splitMix64Engine, &philoxEngine, &aesCtrEngine,
+    };
+    return engines;
+}
+
+const ContentEngine *ContentEngine::find(std::string_view name) {
+    for (auto engine : all()) {
+        if (engine->name() == name) {
+            return engine;
+        }
+    }
+    return nullptr;
+}
+
+const ContentEngine &ContentEngine::getDefault() {
+    return legacyMt19937Engine;
+}
+
+size_t legacyCheckpointMemory() {
+    return legacyCheckpointBytes();
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "keys.h"
+
+class Alphabet;
+class ThreadPool;
+
+// Generates book names and contents. Output depends only on the engine and the
+// key, so every engine name must keep producing the same bytes forever.
+class ContentEngine {
+public:
+    virtual ~ContentEngine() = default;
+
+    virtual std::string_view name() const = 0;
+
+    // Writes symbols [offset, offset + len) of the string identified by key into dst
+    virtual void generate(const Key128 &key, uint64_t offset, char *dst, size_t len) const = 0;
+
+    // Same for a seed string, hashed with stableHash128 unless the engine predates key derivation
+    virtual void generate(const std::string &seed, uint64_t offset, char *dst, size_t len) const;
+
+    // Engines that hash seed strings themselves, library contents are then
+    // identified by the seed strings they have always used instead of the key chain
+    virtual bool usesSeedString() const;
+
+    // False for engines that replay their stream to reach an offset
+    virtual bool isRandomAccess() const;
+
+    // Writes bytes [offset, offset + len) of the text with the given alphabet,
+    // engines that do not support alphabets only take the standard one
+    virtual void generate(const Key128 &key, uint64_t offset, char *dst, size_t len, const Alphabet &alphabet) const;
+
+    virtual bool supportsAlphabets() const;
+
+    // Same output as generate(), ranges larger than parallelBlockSize are split
+    // into blocks generated on the pool
+    void generate(ThreadPool &pool, const Key128 &key, uint64_t offset, char *dst, size_t len) const;
+
+    void generate(ThreadPool &pool, const Key128 &key, uint64_t offset, char *dst, size_t len,
+                  const Alphabet &alphabet) const;
+
+    static const size_t parallelBlockSize = 256 * 1024;
+
+    std::string generate(const Key128 &key, size_t len) const;
+
+    std::string generate(const std::string &seed, size_t len) const;
+
+    static const ContentEngine *find(std::string_view name);
+
+    static const ContentEngine &getDefault();
+
+    static const std::vector<const ContentEngine *> &all();
+};
+
+// Bytes of generator states the legacy engine keeps to resume reads of recently read books
+size_t legacyCheckpointMemory();
@@ -0,0 +1,307 @@
+#include "handle.h"
+#include "babylonfs.h"
+#include "logic.h"
+
+#include <algorithm>
+#include <bit>
+#include <charconv>
+#include <cstring>
+
+namespace {
+
+template <typename... Cases>
+struct Overloaded : Cases... {
+    using Cases::operator()...;
+};
+
+template <typename... Cases>
+Overloaded(Cases...) -> Overloaded<Cases...>;
+
+// Parses a decimal index below count written without leading zeros
+std::optional<int> parseIndex(std::string_view text, int count) {
+    int value = 0;
+    auto [rest, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (error != std::errc() || rest != text.data() + text.size() || value < 0 || value >= count ||
+        (text.size() > 1 && text[0] == '0')) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+// Parses a room number as written in "k<n>", which may be negative in an endless library
+std::optional<int> parseRoomNumber(std::string_view text) {
+    int value = 0;
+    auto [rest, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    auto digits = text.substr(text.starts_with('-') ? 1 : 0);
+    if (error != std::errc() || rest != text.data() + text.size() || (digits.size() > 1 && digits[0] == '0') ||
+        (text.starts_with('-') && value == 0)) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+// Passes prefix and number as one name, formatted on the stack
+void addNumbered(void *context, EntityHandle::NameSink add, std::string_view prefix, int number) {
+    char name[32];
+    auto end = std::copy(prefix.begin(), prefix.end(), name);
+    *std::to_chars(end, name + sizeof(name) - 1, number).ptr = '\0';
+    add(context, name);
+}
+
+RoomData::Basket &notesOf(const EntityHandle::Note &note) {
+    return note.basket.empty() ? note.room->myNotes : note.room->basket(note.basket);
+}
+
+const NoteContent &contentOf(const EntityHandle::Note &note) {
+    return notesOf(note)[note.index];
+}
+
+BookText textOf(const EntityHandle::Book &book) {
+    auto key = book.room->bookKey(book.shelf, book.slot);
+    if (!BabylonFS::getEngine().usesSeedString()) {
+        return BookText::forBook(key, {});
+    }
+    auto names = book.room->shelfNames(book.shelf);
+    return BookText::forBook(key, names->names[book.slot]);
+}
+
+}
+
+bool EntityHandle::isDirectory() const {
+    return !std::holds_alternative<Book>(view) && !std::holds_alternative<Note>(view);
+}
+
+void EntityHandle::stat(struct stat *st) const {
+    if (isDirectory()) {
+        st->st_mode = S_IFDIR | 0755;
+        st->st_nlink = 2;
+    } else {
+        st->st_mode = S_IFREG | 0644;
+        st->st_nlink = 1;
+        st->st_size = getSize();
+    }
+    st->st_ino = inode();
+}
+
+std::optional<Locator> EntityHandle::locate() const {
+    return std::visit(Overloaded{
+        [](const Room &room) -> std::optional<Locator> {
+            return Locator{Locator::Kind::Room, room.room->n};
+        },
+        [](const Bookcase &bookcase) -> std::optional<Locator> {
+            return Locator{Locator::Kind::Bookcase, bookcase.room->n, bookcase.bookcase};
+        },
+        [](const Shelf &shelf) -> std::optional<Locator> {
+            return Locator{Locator::Kind::Shelf, shelf.room->n, shelf.shelf};
+        },
+        [](const Book &book) -> std::optional<Locator> {
+            auto kind = book.room->isOnShelf(book.shelf, book.slot) ? Locator::Kind::ShelfBook
+                                                                    : Locator::Kind::DeskBook;
+            return Locator{kind, book.room->n, book.shelf, book.slot};
+        },
+        [](const Desk &desk) -> std::optional<Locator> {
+            return Locator{Locator::Kind::Desk, desk.room->n};
+        },
+        [](const auto &) -> std::optional<Locator> {
+            // notes and baskets can be renamed through any path to their room
+            return std::nullopt;
+        },
+    }, view);
+}
+
+uint64_t EntityHandle::inode() const {
+    auto &codec = BabylonFS::getInodeCodec();
+    if (auto *basket = std::get_if<Basket>(&view)) {
+        return codec.encode({Locator::Kind::Basket, basket->room->n, 0, basket->room->findItem(basket->name)});
+    }
+    if (auto *note = std::get_if<Note>(&view)) {
+        std::string_view name = contentOf(*note).first;
+        auto item = note->room->findItem(RoomData::itemKey(note->basket, name));
+        return codec.encode({Locator::Kind::Note, note->room->n, 0, item});
+    }
+    return codec.encode(*locate());
+}
+
+std::optional<EntityHandle> EntityHandle::get(std::string_view name) const {
+    return std::visit(Overloaded{
+        [&](const Room &room) -> std::optional<EntityHandle> {
+            auto *data = room.room;
+            std::optional<int> bookcase, neighbour;
+            if (name.starts_with('b')) {
+                bookcase = parseIndex(name.substr(1), BabylonFS::getGeometry().bookcases);
+            } else if (name.starts_with('k')) {
+                neighbour = parseRoomNumber(name.substr(1));
+            }
+            if (bookcase) {
+                return EntityHandle{Bookcase{data, *bookcase}};
+            } else if (neighbour && (*neighbour == data->leftN || *neighbour == data->rightN)) {
+                data->storage->prefetchAround(*neighbour);
+                return EntityHandle{Room{data->storage->getRoom(*neighbour)}};
+            } else if (name == "desk") {
+                return EntityHandle{Desk{data}};
+            }
+            return std::nullopt;
+        },
+        [&](const Bookcase &bookcase) -> std::optional<EntityHandle> {
+            auto shelves = BabylonFS::getGeometry().shelves;
+            if (auto index = parseIndex(name, shelves)) {
+                return EntityHandle{Shelf{bookcase.room, bookcase.bookcase * shelves + *index}};
+            }
+            return std::nullopt;
+        },
+        [&](const Shelf &shelf) -> std::optional<EntityHandle> {
+            int slot = shelf.room->shelfNames(shelf.shelf)->find(name);
+            if (slot != -1 && shelf.room->isOnShelf(shelf.shelf, slot)) {
+                return EntityHandle{Book{shelf.room, shelf.shelf, slot}};
+            }
+            return std::nullopt;
+        },
+        [&](const Desk &desk) -> std::optional<EntityHandle> {
+            auto *room = desk.room;
+            if (auto it = room->myBaskets.find(name); it != room->myBaskets.end()) {
+                return EntityHandle{Basket{room, it->first}};
+            }
+            for (size_t i = 0; i < room->myNotes.size(); ++i) {
+                if (room->myNotes[i].first == name) {
+                    return EntityHandle{Note{room, {}, int(i)}};
+                }
+            }
+            for (const auto &[shelf, taken] : room->takenBooks) {
+                int slot = room->shelfNames(shelf)->find(name);
+                if (slot != -1 && !room->isOnShelf(shelf, slot)) {
+                    return EntityHandle{Book{room, shelf, slot}};
+                }
+            }
+            return std::nullopt;
+        },
+        [&](const Basket &basket) -> std::optional<EntityHandle> {
+            auto &notes = basket.room->basket(basket.name);
+            for (size_t i = 0; i < notes.size(); ++i) {
+                if (notes[i].first == name) {
+                    return EntityHandle{Note{basket.room, basket.name, int(i)}};
+                }
+            }
+            return std::nullopt;
+        },
+        [](const auto &) -> std::optional<EntityHandle> {
+            return std::nullopt;
+        },
+    }, view);
+}
+
+void EntityHandle::list(void *context, NameSink add) const {
+    std::visit(Overloaded{
+        [&](const Room &room) {
+            addNumbered(context, add, "k", room.room->leftN);
+            addNumbered(context, add, "k", room.room->rightN);
+            for (int i = 0; i < BabylonFS::getGeometry().bookcases; ++i) {
+                addNumbered(context, add, "b", i);
+            }
+            add(context, "desk");
+        },
+        [&](const Bookcase &) {
+            for (int i = 0; i < BabylonFS::getGeometry().shelves; ++i) {
+                addNumbered(context, add, "", i);
+            }
+        },
+        [&](const Shelf &shelf) {
+            auto names = shelf.room->shelfNames(shelf.shelf);
+            for (size_t slot = 0; slot < names->names.size(); ++slot) {
+                if (shelf.room->isOnShelf(shelf.shelf, slot)) {
+                    add(context, names->names[slot].c_str());
+                }
+            }
+        },
+        [&](const Desk &desk) {
+            auto *room = desk.room;
+            for (const auto &note : room->myNotes) {
+                add(context, note.first.c_str());
+            }
+            for (const auto &basket : room->myBaskets) {
+                add(context, basket.first.c_str());
+            }
+            for (const auto &[shelf, taken] : room->takenBooks) {
+                auto names = room->shelfNames(shelf);
+                for (size_t word = 0; word < taken.size(); ++word) {
+                    for (uint64_t bits = taken[word]; bits != 0; bits &= bits - 1) {
+                        add(context, names->names[word * 64 + std::countr_zero(bits)].c_str());
+                    }
+                }
+            }
+        },
+        [&](const Basket &basket) {
+            for (const auto &note : basket.room->basket(basket.name)) {
+                add(context, note.first.c_str());
+            }
+        },
+        [](const auto &) {
+            throwError(std::errc::not_a_directory);
+        },
+    }, view);
+}
+
+std::vector<std::string> EntityHandle::getContents() const {
+    std::vector<std::string> names;
+    list(&names, [](void *context, const char *name) {
+        static_cast<std::vector<std::string> *>(context)->emplace_back(name);
+    });
+    return names;
+}
+
+off_t EntityHandle::getSize() const {
+    if (std::holds_alternative<Book>(view)) {
+        return BabylonFS::getGeometry().bookSize;
+    }
+    if (auto *note = std::get_if<Note>(&view)) {
+        return contentOf(*note).second.size();
+    }
+    throwError(std::errc::is_a_directory);
+}
+
+void EntityHandle::readInto(char *dst, size_t size, off_t offset) const {
+    if (auto *book = std::get_if<Book>(&view)) {
+        if (size > 0) {
+            textOf(*book).read(offset, dst, size);
+        }
+    } else if (auto *note = std::get_if<Note>(&view)) {
+        std::memcpy(dst, contentOf(*note).second.data() + offset, size);
+    } else {
+        throwError(std::errc::is_a_directory);
+    }
+}
+
+void EntityHandle::prefetch(off_t offset, size_t size) const {
+    if (auto *book = std::get_if<Book>(&view)) {
+        textOf(*book).prefetch(offset, size);
+    }
+}
+
+Entity::ptr EntityHandle::entity() const {
+    return std::visit(Overloaded{
+        [](const Room &room) -> Entity::ptr {
+            return std::make_unique<::Room>(room.room);
+        },
+        [](const Bookcase &bookcase) -> Entity::ptr {
+            return std::make_unique<::Bookcase>("b" + std::to_string(bookcase.bookcase), bookcase.room,
+                                                bookcase.bookcase);
+        },
+        [](const Shelf &shelf) -> Entity::ptr {
+            return std::make_unique<::Shelf>(RoomData::shelfName(shelf.shelf), shelf.room, shelf.shelf);
+        },
+        [](const Book &book) -> Entity::ptr {
+            auto names = book.room->shelfNames(book.shelf);
+            return std::make_unique<::Book>(names->names[book.slot], book.room, book.shelf, book.slot);
+        },
+        [](const Desk &desk) -> Entity::ptr {
+            return std::make_unique<::Desk>(desk.room);
+        },
+        [](const Basket &basket) -> Entity::ptr {
+            return std::make_unique<Notes>(std::string(basket.name), basket.room);
+        },
+        [](const Note &note) -> Entity::ptr {
+            std::string name(contentOf(note).first);
+            return std::make_unique<::Note>(name, note.index, note.room, !note.basket.empty(),
+                                            std::string(note.basket));
+        },
+    }, view);
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+#include "pathcache.h"
+
+struct RoomData;
+struct Entity;
+
+// Entity found by a path or an inode as a value: a small view into its room,
+// built on the stack and dispatched statically, so lookups, stat, read and
+// readdir allocate nothing. Views only live for one FUSE call; operations that
+// change the library turn them into an Entity first.
+struct EntityHandle {
+    struct Room {
+        RoomData *room;
+    };
+
+    struct Bookcase {
+        RoomData *room;
+        int bookcase;
+    };
+
+    struct Shelf {
+        RoomData *room;
+        // index over all shelves of the room
+        int shelf;
+    };
+
+    struct Book {
+        RoomData *room;
+        int shelf;
+        int slot;
+    };
+
+    struct Desk {
+        RoomData *room;
+    };
+
+    struct Basket {
+        RoomData *room;
+        // the key of the basket in the room, or a name that outlives the view
+        std::string_view name;
+    };
+
+    struct Note {
+        RoomData *room;
+        // empty for a note lying on the desk
+        std::string_view basket;
+        // position in the desk or basket notes
+        int index;
+    };
+
+    // receives the name of each child, FUSE filler style
+    using NameSink = void (*)(void *context, const char *name);
+
+    std::variant<Room, Bookcase, Shelf, Book, Desk, Basket, Note> view;
+
+    bool isDirectory() const;
+
+    // Mode, links, size and inode
+    void stat(struct stat *st) const;
+
+    // Coordinates for the path cache, nullopt for notes and baskets
+    std::optional<Locator> locate() const;
+
+    uint64_t inode() const;
+
+    // Child with this name, nullopt if there is none or this is a file
+    std::optional<EntityHandle> get(std::string_view name) const;
+
+    // Passes the name of every child to add, throws ENOTDIR on a file
+    void list(void *context, NameSink add) const;
+
+    std::vector<std::string> getContents() const;
+
+    // Throws EISDIR on a directory
+    off_t getSize() const;
+
+    // Copies [offset, offset + size) to dst, the range must lie within the file
+    void readInto(char *dst, size_t size, off_t offset) const;
+
+    // Hint that [offset, offset + size) will be read soon
+    void prefetch(off_t offset, size_t size) const;
+
+    // The entity behind the view, for operations that change it
+    std::unique_ptr<Entity> entity() const;
+};
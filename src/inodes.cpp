@@ -0,0 +1,182 @@
+#include "inodes.h"
+
+namespace {
+
+enum Kind : uint64_t {
+    Room,
+    Bookcase,
+    Shelf,
+    Book,
+    Desk,
+    Note,
+    Basket,
+};
+
+const int kindShift = 61;
+const int roomShift = 29;
+
+}
+
+InodeCodec::InodeCodec(int bookcases, int shelves, int booksPerShelf) :
+    bookcases(bookcases), shelves(shelves), booksPerShelf(booksPerShelf) {}
+
+uint64_t InodeCodec::encode(const Locator &locator) const {
+    uint64_t kind = Room;
+    uint64_t number = 0;
+    switch (locator.kind) {
+        case Locator::Kind::Room:
+            break;
+        case Locator::Kind::Bookcase:
+            kind = Bookcase;
+            number = locator.index;
+            break;
+        case Locator::Kind::Shelf:
+            kind = Shelf;
+            number = locator.index;
+            break;
+        case Locator::Kind::ShelfBook:
+        case Locator::Kind::DeskBook:
+            kind = Book;
+            number = uint64_t(locator.index) * booksPerShelf + locator.slot;
+            break;
+        case Locator::Kind::Desk:
+            kind = Desk;
+            break;
+        case Locator::Kind::Note:
+            kind = Note;
+            number = locator.slot;
+            break;
+        case Locator::Kind::Basket:
+            kind = Basket;
+            number = locator.slot;
+            break;
+    }
+    // the room 0 at the root gets inode 1, which FUSE reserves for the root
+    return 1 + (kind << kindShift | uint64_t(uint32_t(locator.room)) << roomShift | number);
+}
+
+std::optional<Locator> InodeCodec::decode(uint64_t ino) const {
+    if (ino == 0) {
+        return std::nullopt;
+    }
+    auto code = ino - 1;
+    auto kind = code >> kindShift;
+    int room = int32_t(uint32_t(code >> roomShift));
+    int number = int(code & (maxNumber - 1));
+    switch (kind) {
+        case Room:
+            if (number == 0) {
+                return Locator{Locator::Kind::Room, room};
+            }
+            break;
+        case Bookcase:
+            if (number < bookcases) {
+                return Locator{Locator::Kind::Bookcase, room, number};
+            }
+            break;
+        case Shelf:
+            if (number < bookcases * shelves) {
+                return Locator{Locator::Kind::Shelf, room, number};
+            }
+            break;
+        case Book:
+            if (number < bookcases * shelves * booksPerShelf) {
+                return Locator{Locator::Kind::ShelfBook, room, number / booksPerShelf, number % booksPerShelf};
+            }
+            break;
+        case Desk:
+            if (number == 0) {
+                return Locator{Locator::Kind::Desk, room};
+            }
+            break;
+        case Note:
+            return Locator{Locator::Kind::Note, room, 0, number};
+        case Basket:
+            return Locator{Locator::Kind::Basket, room, 0, number};
+    }
+    return std::nullopt;
+}
+
+bool InodeTable::isDynamic(uint64_t id) {
+    return id >= InodeCodec::firstDynamic;
+}
+
+uint64_t InodeTable::lookup(uint64_t parent, std::string_view name, uint64_t inode) {
+    std::lock_guard lock(mutex);
+    ++lookups;
+    if (auto it = children.find(std::pair{parent, name}); it != children.end()) {
+        auto &entry = nodes.at(it->second);
+        ++entry.lookups;
+        entry.node.inode = inode;
+        return it->second;
+    }
+    auto id = next++;
+    nodes.emplace(id, Entry{Node{parent, std::string(name), inode}, 1});
+    children.emplace(Key{parent, name}, id);
+    return id;
+}
+
+std::optional<InodeTable::Node> InodeTable::get(uint64_t id) const {
+    std::lock_guard lock(mutex);
+    if (auto it = nodes.find(id); it != nodes.end()) {
+        return it->second.node;
+    }
+    return std::nullopt;
+}
+
+void InodeTable::forget(uint64_t id, uint64_t count) {
+    std::lock_guard lock(mutex);
+    auto it = nodes.find(id);
+    if (it == nodes.end()) {
+        return;
+    }
+    if (it->second.lookups > count) {
+        it->second.lookups -= count;
+        return;
+    }
+    auto &node = it->second.node;
+    if (auto child = children.find(std::pair{node.parent, std::string_view(node.name)});
+        child != children.end() && child->second == id) {
+        children.erase(child);
+    }
+    nodes.erase(it);
+    ++forgotten;
+}
+
+void InodeTable::remove(uint64_t parent, std::string_view name) {
+    std::lock_guard lock(mutex);
+    if (auto it = children.find(std::pair{parent, name}); it != children.end()) {
+        detach(it->second);
+        children.erase(it);
+    }
+}
+
+void InodeTable::move(uint64_t parent, std::string_view name, uint64_t newParent, std::string_view newName) {
+    std::lock_guard lock(mutex);
+    auto it = children.find(std::pair{parent, name});
+    if (it == children.end()) {
+        return;
+    }
+    auto id = it->second;
+    children.erase(it);
+    if (auto replaced = children.find(std::pair{newParent, newName}); replaced != children.end()) {
+        detach(replaced->second);
+        children.erase(replaced);
+    }
+    auto &node = nodes.at(id).node;
+    node.parent = newParent;
+    node.name = newName;
+    children.emplace(Key{newParent, newName}, id);
+}
+
+InodeTable::Stats InodeTable::stats() const {
+    std::lock_guard lock(mutex);
+    return {nodes.size(), lookups, forgotten};
+}
+
+void InodeTable::detach(uint64_t id) {
+    // the node id stays valid until it is forgotten, but leads nowhere
+    auto &node = nodes.at(id).node;
+    node.parent = 0;
+    node.inode = 0;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+#include "pathcache.h"
+
+// Packs library coordinates into 64-bit inode numbers and back. An inode is
+// 1 + kind << 61 | room << 29 | number, where the number is the bookcase,
+// the shelf over the room, shelf * booksPerShelf + slot for books, or the item
+// number of a note or basket. Inodes only depend on the geometry, so they are
+// the same on every mount; a book keeps its inode when it is moved to the desk.
+class InodeCodec {
+public:
+    // bound on bookcases * shelves * booksPerShelf and on desk items of a room
+    static constexpr uint64_t maxNumber = uint64_t(1) << 29;
+    // inodes from here on are not coordinates, see InodeTable
+    static constexpr uint64_t firstDynamic = (uint64_t(7) << 61) + 1;
+
+    InodeCodec(int bookcases, int shelves, int booksPerShelf);
+
+    uint64_t encode(const Locator &locator) const;
+
+    // Coordinates of an inode, nullopt for a number encode() never returns.
+    // Books come back as ShelfBook whether or not they are on their shelf.
+    std::optional<Locator> decode(uint64_t ino) const;
+
+private:
+    int bookcases;
+    int shelves;
+    int booksPerShelf;
+};
+
+// Node ids of directories handed out to the kernel by the low-level frontend.
+// Rooms are reachable along endless paths and the kernel refuses a directory
+// that shows up below itself, so each path gets a node id of its own, known by
+// the directory it was looked up in and its name there. A node remembers the
+// inode of its directory and lives until the kernel forgets every lookup of it.
+// Files have no nodes, their inode is their node id.
+class InodeTable {
+public:
+    struct Node {
+        uint64_t parent;
+        std::string name;
+        uint64_t inode;
+    };
+
+    struct Stats {
+        size_t nodes;
+        uint64_t lookups;
+        uint64_t forgotten;
+    };
+
+    static bool isDynamic(uint64_t id);
+
+    // Node id of the child directory named name, counting one more lookup by the kernel
+    uint64_t lookup(uint64_t parent, std::string_view name, uint64_t inode);
+
+    // The node, nullopt for a node id that was forgotten or never handed out
+    std::optional<Node> get(uint64_t id) const;
+
+    // Drops count lookups of the node, it goes away with the last one
+    void forget(uint64_t id, uint64_t count);
+
+    // The child is gone, its node no longer answers to the name
+    void remove(uint64_t parent, std::string_view name);
+
+    // The child now lives in newParent under newName
+    void move(uint64_t parent, std::string_view name, uint64_t newParent, std::string_view newName);
+
+    Stats stats() const;
+
+private:
+    struct Entry {
+        Node node;
+        uint64_t lookups;
+    };
+
+    using Key = std::pair<uint64_t, std::string>;
+
+    struct KeyLess {
+        using is_transparent = void;
+
+        template <typename A, typename B>
+        bool operator()(const A &a, const B &b) const {
+            return a.first != b.first ? a.first < b.first : std::string_view(a.second) < std::string_view(b.second);
+        }
+    };
+
+    void detach(uint64_t id);
+
+    mutable std::mutex mutex;
+    std::unordered_map<uint64_t, Entry> nodes;
+    std::map<Key, uint64_t, KeyLess> children;
+    uint64_t next = InodeCodec::firstDynamic;
+    uint64_t lookups = 0, forgotten = 0;
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+// Key derivation for library contents. This header has no dependencies, so
+// clients can copy it to reproduce names and books offline:
+//
+//     library  = libraryKey(seed)
+//     room     = roomKey(library, n)          n is the room number, k<n>
+//     bookcase = childKey(room, b)            b in 0..bookcases-1 for b<b>
+//     shelf    = childKey(bookcase, s)        s in 0..shelves-1
+//     book     = childKey(shelf, i)           i is the slot on the shelf
+//
+// The book name is generated from bookNameKey(book) and the text from
+// bookContentKey(book), with the engine selected by --generator.
+
+#include <cstdint>
+#include <string_view>
+
+struct Key128 {
+    uint64_t lo;
+    uint64_t hi;
+
+    constexpr bool operator==(const Key128 &) const = default;
+};
+
+// splitmix64 finalizer
+constexpr uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// FNV-1a followed by mix64 to spread the low-entropy tail
+constexpr uint64_t fnv1aMix(std::string_view data, uint64_t basis) {
+    uint64_t h = basis;
+    for (unsigned char c : data) {
+        h ^= c;
+        h *= 0x100000001b3ULL;
+    }
+    return mix64(h);
+}
+
+// Stable across platforms and standard libraries, unlike std::hash
+constexpr uint64_t stableHash(std::string_view data) {
+    return fnv1aMix(data, 0xcbf29ce484222325ULL);
+}
+
+// The low half equals stableHash(data)
+constexpr Key128 stableHash128(std::string_view data) {
+    return {stableHash(data), fnv1aMix(data, 0x6c62272e07bb0142ULL)};
+}
+
+constexpr Key128 childKey(const Key128 &parent, uint64_t child) {
+    uint64_t salt = mix64(child + 0x9e3779b97f4a7c15ULL);
+    uint64_t lo = mix64(parent.lo ^ salt);
+    uint64_t hi = mix64(parent.hi ^ lo ^ child);
+    return {lo, hi};
+}
+
+constexpr Key128 libraryKey(std::string_view seed) {
+    return stableHash128(seed);
+}
+
+constexpr Key128 roomKey(const Key128 &library, int64_t room) {
+    return childKey(library, uint64_t(room));
+}
+
+constexpr Key128 bookNameKey(const Key128 &book) {
+    return childKey(book, 0);
+}
+
+constexpr Key128 bookContentKey(const Key128 &book) {
+    return childKey(book, 1);
+}
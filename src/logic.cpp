@@ -2,45 +2,313 @@
 #include "logic.h"
 #include "util.h"
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <optional>
 #include <utility>
 #include <iostream>
 
-static const int bookSize = 4096 * 256;
+// book names kept in name tables of rooms that are not visited right now
+static const size_t nameCacheSize = 64 * 1024;
 
-Entity::ptr BabylonFS::getRoot() {
-    static RoomStorage roomStorage{cycle};
-    return std::make_unique<Room>(roomStorage.getRoom(0));
+RoomStorage &BabylonFS::getRooms() {
+    std::call_once(roomsCreated, [this] {
+        size_t limit = maxRooms;
+        if (roomMemory != 0) {
+            size_t byMemory = std::max<size_t>(roomMemory / RoomStorage::roomFootprint, 1);
+            limit = limit == 0 ? byMemory : std::min(limit, byMemory);
+        }
+        rooms = std::make_unique<RoomStorage>(cycle, limit, prefetchRooms, prefetchNames);
+    });
+    return *rooms;
+}
+
+BabylonFS::~BabylonFS() {
+    stopPrewarm();
+}
+
+EntityHandle BabylonFS::getRoot() {
+    return {EntityHandle::Room{getRooms().getRoom(0)}};
+}
+
+std::optional<EntityHandle> BabylonFS::resolve(const Locator &locator) {
+    auto *room = getRooms().getRoom(locator.room);
+    switch (locator.kind) {
+        case Locator::Kind::Room:
+            // the walk would have entered the room just now
+            room->storage->prefetchAround(locator.room);
+            return EntityHandle{EntityHandle::Room{room}};
+        case Locator::Kind::Bookcase:
+            return EntityHandle{EntityHandle::Bookcase{room, locator.index}};
+        case Locator::Kind::Shelf:
+            return EntityHandle{EntityHandle::Shelf{room, locator.index}};
+        case Locator::Kind::ShelfBook:
+        case Locator::Kind::DeskBook: {
+            bool onShelf = locator.kind == Locator::Kind::ShelfBook;
+            if (room->isOnShelf(locator.index, locator.slot) != onShelf) {
+                return std::nullopt;
+            }
+            auto names = room->shelfNames(locator.index);
+            std::string_view name = names->names[locator.slot];
+            // notes and baskets on the desk hide books with the same name
+            auto hides = [&](const NoteContent &note) { return note.first == name; };
+            if (!onShelf && (room->myBaskets.contains(name) ||
+                             std::any_of(room->myNotes.begin(), room->myNotes.end(), hides))) {
+                return std::nullopt;
+            }
+            return EntityHandle{EntityHandle::Book{room, locator.index, locator.slot}};
+        }
+        case Locator::Kind::Desk:
+            return EntityHandle{EntityHandle::Desk{room}};
+        case Locator::Kind::Note:
+        case Locator::Kind::Basket:
+            // never cached, found by resolveInode()
+            break;
+    }
+    return std::nullopt;
+}
+
+std::optional<EntityHandle> BabylonFS::resolveInode(uint64_t ino) {
+    auto locator = inodeCodec.decode(ino);
+    if (!locator) {
+        return std::nullopt;
+    }
+    auto *room = getRooms().getRoom(locator->room);
+    auto item = locator->slot;
+    switch (locator->kind) {
+        case Locator::Kind::ShelfBook:
+            if (!room->isOnShelf(locator->index, locator->slot)) {
+                locator->kind = Locator::Kind::DeskBook;
+            }
+            break;
+        case Locator::Kind::Note:
+        case Locator::Kind::Basket: {
+            auto *key = room->findItemKey(item);
+            if (!key) {
+                return std::nullopt;
+            }
+            // views point into the key, which stays put until the item is renamed
+            auto [basket, name] = splitParent(*key);
+            bool isBasket = room->myBaskets.contains(name) && basket.empty();
+            if (isBasket != (locator->kind == Locator::Kind::Basket)) {
+                return std::nullopt;
+            }
+            if (isBasket) {
+                return EntityHandle{EntityHandle::Basket{room, name}};
+            }
+            auto &notes = basket.empty() ? room->myNotes : room->basket(basket);
+            for (size_t i = 0; i < notes.size(); ++i) {
+                if (notes[i].first == name) {
+                    return EntityHandle{EntityHandle::Note{room, basket, int(i)}};
+                }
+            }
+            return std::nullopt;
+        }
+        default:
+            break;
+    }
+    return resolve(*locator);
+}
+
+void BabylonFS::prewarm() {
+    auto start = std::chrono::steady_clock::now();
+    RoomData::keepNames(size_t(cycle) * RoomData::shelfCount() * geometry.booksPerShelf);
+    int warmBooks = int64_t(geometry.booksPerShelf) * prewarmContent / 100;
+    std::cerr << "babylonfs: prewarming " << cycle << " rooms";
+    if (warmBooks > 0) {
+        std::cerr << " and " << warmBooks << " books per shelf";
+    }
+    std::cerr << std::endl;
+
+    std::atomic<int> done{0};
+    pool->parallelFor(cycle, [&](size_t n) {
+        if (prewarmStopped) {
+            return;
+        }
+        // a detached copy, so warming never races with FUSE calls on the room storage
+        RoomData room(n, cycle);
+        std::vector<char> scratch(warmBooks > 0 ? contentBlockSize : 0);
+        for (int shelf = 0; shelf < RoomData::shelfCount(); ++shelf) {
+            // the name table stays cached for later walks through the room
+            room.shelfNames(shelf);
+            for (int slot = 0; slot < warmBooks && !prewarmStopped; ++slot) {
+                EntityHandle book{EntityHandle::Book{&room, shelf, slot}};
+                for (off_t offset = 0; offset < book.getSize(); offset += contentBlockSize) {
+                    book.readInto(scratch.data(), std::min<off_t>(contentBlockSize, book.getSize() - offset), offset);
+                }
+            }
+        }
+        int finished = ++done;
+        if (finished * 10 / cycle != (finished - 1) * 10 / cycle) {
+            std::cerr << "babylonfs: prewarm " << finished * 100 / cycle << "% (" << finished << "/" << cycle
+                      << " rooms)" << std::endl;
+        }
+    });
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << "babylonfs: prewarm " << (prewarmStopped ? "stopped" : "finished") << " after "
+              << elapsed.count() << " s" << std::endl;
+}
+
+void BabylonFS::stopPrewarm() {
+    prewarmStopped = true;
+    if (prewarmThread.joinable()) {
+        prewarmThread.join();
+    }
 }
 
-Book::Book(const std::string &name, RoomData *myRoom, std::string shelf_name) : myRoom(myRoom), shelfName(std::move(shelf_name)) {
+Book::Book(std::string_view name, RoomData *myRoom, int shelf, int slot) :
+    myRoom(myRoom), shelf(shelf), slot(slot) {
     this->name = name;
+    key = myRoom->bookKey(shelf, slot);
+}
+
+void BookText::generate(uint64_t offset, char *dst, size_t len) const {
+    if (engine->usesSeedString()) {
+        engine->generate(seed, offset, dst, len);
+    } else {
+        engine->generate(BabylonFS::getPool(), key, offset, dst, len, *alphabet);
+    }
+}
+
+BlockId BookText::blockId(uint64_t index) const {
+    return {engine, key, index};
+}
+
+BlockCache::Block BookText::generateBlock(uint64_t index) const {
+    uint64_t start = index * contentBlockSize;
+    auto block = std::make_shared<std::string>(std::min(contentBlockSize, BabylonFS::getGeometry().bookSize - start), '\0');
+    generate(start, block->data(), block->size());
+    return block;
+}
+
+BlockCache::Block BookText::loadBlock(uint64_t index) const {
+    return BabylonFS::getBlockFlights().run(blockId(index), [&] {
+        auto block = generateBlock(index);
+        BabylonFS::getContentCache().put(blockId(index), block);
+        return block;
+    });
+}
+
+void BookText::read(uint64_t offset, char *dst, size_t len) const {
+    auto &cache = BabylonFS::getContentCache();
+    if (cache.getCapacity() == 0) {
+        generate(offset, dst, len);
+        return;
+    }
+
+    auto copyBlock = [&](uint64_t i, const std::string &block) {
+        uint64_t start = std::max(offset, i * contentBlockSize);
+        uint64_t end = std::min(offset + len, (i + 1) * contentBlockSize);
+        std::copy(block.begin() + (start - i * contentBlockSize), block.begin() + (end - i * contentBlockSize),
+                  dst + (start - offset));
+    };
+
+    // cached blocks are copied right away, only the missing ones are collected
+    uint64_t first = offset / contentBlockSize;
+    uint64_t last = (offset + len - 1) / contentBlockSize;
+    std::vector<uint64_t> missing;
+    for (uint64_t i = first; i <= last; ++i) {
+        if (auto block = cache.get(blockId(i))) {
+            copyBlock(i, *block);
+        } else {
+            missing.push_back(i);
+        }
+    }
+    if (missing.empty()) {
+        return;
+    }
+
+    auto generateMissing = [&](size_t j) {
+        copyBlock(missing[j], *loadBlock(missing[j]));
+    };
+    if (engine->isRandomAccess()) {
+        BabylonFS::getPool().parallelFor(missing.size(), generateMissing);
+    } else {
+        for (size_t j = 0; j < missing.size(); ++j) {
+            generateMissing(j);
+        }
+    }
+}
+
+void BookText::prefetch(off_t offset, size_t size) const {
+    auto &cache = BabylonFS::getContentCache();
+    auto &pool = BabylonFS::getPool();
+    auto bookSize = BabylonFS::getGeometry().bookSize;
+    if (cache.getCapacity() == 0 || pool.size() == 0 || uint64_t(offset) >= bookSize) {
+        return;
+    }
+    size = std::min<uint64_t>(size, bookSize - offset);
+    for (uint64_t i = offset / contentBlockSize; i * contentBlockSize < offset + size; ++i) {
+        if (cache.contains(blockId(i))) {
+            continue;
+        }
+        pool.submit([source = *this, i] {
+            source.loadBlock(i);
+        });
+    }
+}
+
+BookText BookText::forBook(const Key128 &key, std::string_view name) {
+    auto &engine = BabylonFS::getEngine();
+    auto &alphabet = BabylonFS::getAlphabet();
+    if (engine.usesSeedString()) {
+        auto &librarySeed = BabylonFS::getSeed();
+        std::string seed;
+        seed.reserve(librarySeed.size() + 1 + name.size());
+        seed.append(librarySeed).append(":").append(name);
+        return {&engine, &alphabet, stableHash128(seed), std::move(seed)};
+    }
+    return {&engine, &alphabet, bookContentKey(key), {}};
+}
+
+BookText Book::text() const {
+    return BookText::forBook(key, name);
 }
 
-int Book::getSize() {
-    return bookSize;
+EntityHandle Book::handle() const {
+    return {EntityHandle::Book{myRoom, shelf, slot}};
+}
+
+off_t Book::getSize() {
+    return BabylonFS::getGeometry().bookSize;
+}
+
+void Book::prefetch(off_t offset, size_t size) {
+    text().prefetch(offset, size);
 }
 
 std::string_view Book::getContents() {
-    if (contents.empty()) {
-        contents = generateStringFromSeed(BabylonFS::getSeed() + ":" + name, bookSize);
+    auto size = BabylonFS::getGeometry().bookSize;
+    if (contents.size() != size) {
+        contents.resize(size);
+        text().read(0, contents.data(), contents.size());
     }
     return contents;
 }
 
+void Book::readInto(char *dst, size_t size, off_t offset) {
+    if (contents.size() == BabylonFS::getGeometry().bookSize) {
+        std::copy_n(contents.begin() + offset, size, dst);
+    } else if (size > 0) {
+        text().read(offset, dst, size);
+    }
+}
+
 void Book::move(Entity &to, const std::string& newName) {
-    if (auto shelf = dynamic_cast<Shelf *>(&to)) {
-        if (myRoom != shelf->myRoom) {
+    if (auto target = dynamic_cast<Shelf *>(&to)) {
+        if (myRoom != target->myRoom) {
             throwError(std::errc::invalid_argument);
         }
-        if (shelf->name == shelfName) {
-            auto& taken_books = myRoom->takenBooks[shelfName];
-            auto it = std::find(taken_books.begin(), taken_books.end(), name);
-            if (std::find(taken_books.begin(), taken_books.end(), name) == taken_books.end()) {
+        if (target->shelf == shelf) {
+            if (myRoom->isOnShelf(shelf, slot)) {
                 throwError(std::errc::invalid_argument);
-            } else {
-                myRoom->shelfToBook[shelfName].push_back(name);
             }
-            taken_books.erase(it);
+            myRoom->returnBook(shelf, slot);
         } else {
             throwError(std::errc::permission_denied);
         }
@@ -48,76 +316,52 @@ void Book::move(Entity &to, const std::string& newName) {
         if (myRoom != desk->myRoom) {
             throwError(std::errc::invalid_argument);
         }
-        auto& shelfBooks = myRoom->shelfToBook[shelfName];
-        auto it = std::find(shelfBooks.begin(), shelfBooks.end(), name);
-        if (it == shelfBooks.end()) {
+        if (!myRoom->isOnShelf(shelf, slot)) {
             throwError(std::errc::invalid_argument);
-        } else {
-            myRoom->takenBooks[shelfName].push_back(name);
         }
-        shelfBooks.erase(it);
+        myRoom->takeBook(shelf, slot);
     }
 }
 
-Shelf::Shelf(std::string name, RoomData *myRoom) : myRoom(myRoom) {
+Shelf::Shelf(std::string name, RoomData *myRoom, int shelf) : myRoom(myRoom), shelf(shelf) {
     this->name = name;
 }
 
-Bookcase::Bookcase(std::string name, RoomData *myRoom) : myRoom(myRoom) {
+Bookcase::Bookcase(std::string name, RoomData *myRoom, int bookcase) : myRoom(myRoom), bookcase(bookcase) {
     this->name = name;
 }
 
-std::vector<std::string> Bookcase::getContents() {
-    return {"0", "1", "2", "3", "4"};
+EntityHandle Shelf::handle() const {
+    return {EntityHandle::Shelf{myRoom, shelf}};
 }
 
-Entity::ptr Bookcase::get(const std::string &name) {
-    if (name == "0" || name == "1" || name == "2" || name == "3" || name == "4") {
-        return std::make_unique<Shelf>(this->name + name, myRoom);
-    }
-    return nullptr;
+EntityHandle Bookcase::handle() const {
+    return {EntityHandle::Bookcase{myRoom, bookcase}};
 }
 
-std::vector<std::string> Desk::getContents() {
-    std::vector<std::string> res;
-
-    for(const auto &kek : myRoom->myNotes) {
-        res.push_back(kek.first);
-    }
+Desk::Desk(RoomData *myRoom) : myRoom(myRoom) {}
 
-    for(const auto &kek: myRoom->myBaskets) {
-        res.push_back(kek.first);
-    }
-    for (const auto &kek: myRoom->takenBooks) {
-        for (const auto &kek2: kek.second) {
-            res.push_back(kek2);
-        }
-    }
-    return res;
+EntityHandle Desk::handle() const {
+    return {EntityHandle::Desk{myRoom}};
 }
 
-Desk::Desk(RoomData *myRoom) : myRoom(myRoom) {}
-
 void Desk::createDirectory(const std::string &name) {
     auto contents = getContents();
     auto it = std::find(contents.begin(), contents.end(), name);
     if (it != contents.end()) {
         throwError(std::errc::invalid_argument);
     }
-    myRoom->myBaskets[name] = {};
+    // numbered first, so a room out of numbers is left unchanged
+    myRoom->addItem(name);
+    myRoom->myBaskets.try_emplace(std::pmr::string(name));
 }
 
 Notes::Notes(std::string name, RoomData *myRoom) : myRoom(myRoom) {
     this->name = name;
 }
 
-std::vector<std::string> Notes::getContents() {
-    std::vector<std::string> res;
-    auto& myNotes = myRoom->myBaskets.at(this->name);
-    for (const auto &kek: myNotes) {
-        res.push_back(kek.first);
-    }
-    return res;
+EntityHandle Notes::handle() const {
+    return {EntityHandle::Basket{myRoom, name}};
 }
 
 Note::Note(const std::string &name, int id, RoomData *myRoom, bool isBasket, std::string basketName) :
@@ -125,69 +369,244 @@ Note::Note(const std::string &name, int id, RoomData *myRoom, bool isBasket, std
     this->name = name;
 }
 
-RoomData::RoomData(int n, int cycle) : cycle(cycle) {
+std::pair<int, int> RoomData::neighbours(int n, int cycle) {
     if (cycle == -1) {
-        leftN = n - 1;
-        rightN = n + 1;
-    } else {
-        if (n == 0) {
-            leftN = cycle - 1;
-            rightN = 1;
-        } else if (n == cycle - 1) {
-            leftN = n - 1;
-            rightN = 0;
-        } else {
-            leftN = n - 1;
-            rightN = n + 1;
+        return {n - 1, n + 1};
+    }
+    if (n == 0) {
+        return {cycle - 1, 1};
+    }
+    if (n == cycle - 1) {
+        return {n - 1, 0};
+    }
+    return {n - 1, n + 1};
+}
+
+RoomData::RoomData(int n, int cycle) : n(n), key(roomKey(BabylonFS::getLibraryKey(), n)), cycle(cycle) {
+    std::tie(leftN, rightN) = neighbours(n, cycle);
+}
+
+int NameTable::find(std::string_view name) const {
+    auto it = slots.find(name);
+    return it == slots.end() ? -1 : it->second;
+}
+
+namespace {
+
+struct NameTableId {
+    const ContentEngine *engine;
+    Key128 shelf;
+    // a mount with another geometry must not get a table of the old width
+    int books;
+
+    bool operator==(const NameTableId &) const = default;
+};
+
+struct NameTableIdHash {
+    size_t operator()(const NameTableId &id) const noexcept {
+        return id.shelf.lo ^ mix64(id.shelf.hi ^ reinterpret_cast<uintptr_t>(id.engine) ^ id.books);
+    }
+};
+
+// Least recently used name tables, rooms themselves only keep presence bits
+class NameTableCache {
+public:
+    using Table = std::shared_ptr<const NameTable>;
+
+    template <typename Make>
+    Table get(const NameTableId &id, Make &&make) {
+        std::unique_lock lock(mutex);
+        if (auto it = index.find(id); it != index.end()) {
+            order.splice(order.begin(), order, it->second);
+            return it->second->second;
+        }
+        lock.unlock();
+        Table table = make();
+        lock.lock();
+        if (index.contains(id)) {
+            return table;
         }
+        order.emplace_front(id, table);
+        index.emplace(id, order.begin());
+        names += table->names.size();
+        while (names > capacity && order.size() > 1) {
+            names -= order.back().second->names.size();
+            index.erase(order.back().first);
+            order.pop_back();
+        }
+        return table;
     }
-    for (auto kek : {"b0", "b1", "b2","b3"}) {
-        for (auto kek2 : {"0", "1", "2", "3", "4"}) {
-            auto shelfName = std::string(kek) + kek2;
-            auto seed = std::to_string(n) + kek + kek2;
-            std::vector<std::string> names(32);
-            for (int i = 0; i < names.size(); ++i) {
-                names[i] = generateStringFromSeed(BabylonFS::getSeed() + ":" + shelfName + "/book/" + std::to_string(i), 16);
+
+    // Keeps at least count names cached
+    void reserve(size_t count) {
+        std::lock_guard lock(mutex);
+        capacity = std::max(capacity, count);
+    }
+
+private:
+    std::mutex mutex;
+    size_t capacity = nameCacheSize;
+    size_t names = 0;
+    std::list<std::pair<NameTableId, Table>> order;
+    std::unordered_map<NameTableId, decltype(order)::iterator, NameTableIdHash> index;
+};
+
+NameTableCache nameTables;
+
+}
+
+int RoomData::shelfCount() {
+    auto &geometry = BabylonFS::getGeometry();
+    return geometry.bookcases * geometry.shelves;
+}
+
+std::string RoomData::shelfName(int shelf) {
+    auto shelves = BabylonFS::getGeometry().shelves;
+    auto bookcase = std::to_string(shelf / shelves);
+    // digits are only unambiguous without a separator while there are at most ten shelves
+    return "b" + bookcase + (shelves <= 10 ? "" : "/") + std::to_string(shelf % shelves);
+}
+
+std::shared_ptr<const NameTable> RoomData::shelfNames(int shelf) const {
+    auto &engine = BabylonFS::getEngine();
+    auto name = shelfName(shelf);
+    // legacy names do not depend on the room
+    auto shelves = BabylonFS::getGeometry().shelves;
+    auto booksPerShelf = BabylonFS::getGeometry().booksPerShelf;
+    auto id = engine.usesSeedString() ? stableHash128(BabylonFS::getSeed() + ":" + name)
+                                      : childKey(childKey(key, shelf / shelves), shelf % shelves);
+    return nameTables.get({&engine, id, booksPerShelf}, [&] {
+        auto table = std::make_shared<NameTable>();
+        table->names.resize(booksPerShelf);
+        table->slots.reserve(booksPerShelf);
+        for (int i = 0; i < booksPerShelf; ++i) {
+            if (engine.usesSeedString()) {
+                table->names[i] = engine.generate(BabylonFS::getSeed() + ":" + name + "/book/" + std::to_string(i), 16);
+            } else {
+                table->names[i] = engine.generate(bookNameKey(childKey(id, i)), 16);
             }
-            shelfToBook[shelfName] = names;
+            table->slots.emplace(table->names[i], i);
+        }
+        return table;
+    });
+}
+
+void RoomData::keepNames(size_t count) {
+    nameTables.reserve(count);
+}
+
+std::vector<std::string> RoomData::shelfBooks(int shelf) const {
+    auto names = shelfNames(shelf);
+    auto it = takenBooks.find(shelf);
+    if (it == takenBooks.end()) {
+        return names->names;
+    }
+    std::vector<std::string> res;
+    for (size_t slot = 0; slot < names->names.size(); ++slot) {
+        if (!(it->second[slot / 64] >> slot % 64 & 1)) {
+            res.push_back(names->names[slot]);
         }
     }
+    return res;
 }
 
-Room::Room(RoomData* data) : data(data) {}
+bool RoomData::isOnShelf(int shelf, int slot) const {
+    auto it = takenBooks.find(shelf);
+    return it == takenBooks.end() || !(it->second[slot / 64] >> slot % 64 & 1);
+}
 
-std::vector<std::string> Room::getContents() {
-    return {
-            "k" + std::to_string(data->leftN),
-            "k" + std::to_string(data->rightN),
-            "b0", "b1", "b2", "b3", "desk"
-    };
+void RoomData::takeBook(int shelf, int slot) {
+    auto &taken = takenBooks[shelf];
+    taken.resize((BabylonFS::getGeometry().booksPerShelf + 63) / 64);
+    taken[slot / 64] |= uint64_t{1} << slot % 64;
 }
 
-Entity::ptr Room::get(const std::string &name) {
-    if (name == "b0" || name == "b1" || name == "b2" || name == "b3") {
-        return std::make_unique<Bookcase>(name, data);
-    } else if (name == "k" + std::to_string(data->leftN)) {
-        return std::make_unique<Room>(data->storage->getRoom(data->leftN));
-    } else if (name == "k" + std::to_string(data->rightN)) {
-        return std::make_unique<Room>(data->storage->getRoom(data->rightN));
-    } else if (name == "desk") {
-        return std::make_unique<Desk>(data);
+void RoomData::returnBook(int shelf, int slot) {
+    auto it = takenBooks.find(shelf);
+    if (it == takenBooks.end()) {
+        return;
+    }
+    it->second[slot / 64] &= ~(uint64_t{1} << slot % 64);
+    if (std::all_of(it->second.begin(), it->second.end(), [](uint64_t bits) { return bits == 0; })) {
+        takenBooks.erase(it);
     }
-    return nullptr;
 }
 
-Entity::ptr Notes::get(const std::string &name) {
-    int id = -1;
-    auto &myNotes = myRoom->myBaskets[this->name];
-    for (size_t i = 0; i < myNotes.size(); ++i) {
-        if (myNotes[i].first == name) {
-            id = i;
-            break;
-        }
+Key128 RoomData::bookKey(int shelf, int slot) const {
+    auto shelves = BabylonFS::getGeometry().shelves;
+    return childKey(childKey(childKey(key, shelf / shelves), shelf % shelves), slot);
+}
+
+RoomData::Basket &RoomData::basket(std::string_view name) {
+    auto it = myBaskets.find(name);
+    if (it == myBaskets.end()) {
+        throwError(std::errc::no_such_file_or_directory);
     }
-    if (id == -1) return nullptr;
-    return std::make_unique<Note>(name, id, myRoom, true, this->name);
+    return it->second;
+}
+
+bool RoomData::isPristine() const {
+    // item numbers must not be handed out again, even after the last note is gone
+    return myNotes.empty() && myBaskets.empty() && lastItem == 0 && takenBooks.empty();
+}
+
+std::string RoomData::itemKey(std::string_view basket, std::string_view name) {
+    return basket.empty() ? std::string(name) : std::string(basket) + "/" + std::string(name);
+}
+
+void RoomData::addItem(std::string_view key) {
+    if (lastItem + 1 >= InodeCodec::maxNumber) {
+        throwError(std::errc::no_space_on_device);
+    }
+    if (auto it = items.find(key); it != items.end()) {
+        itemKeys.erase(it->second);
+        items.erase(it);
+    }
+    auto [it, added] = items.emplace(std::pmr::string(key), int(++lastItem));
+    itemKeys[it->second] = &it->first;
+}
+
+int RoomData::findItem(std::string_view key) const {
+    auto it = items.find(key);
+    return it != items.end() ? it->second : 0;
+}
+
+const std::pmr::string *RoomData::findItemKey(int item) const {
+    auto it = itemKeys.find(item);
+    return it != itemKeys.end() ? it->second : nullptr;
+}
+
+void RoomData::moveItem(std::string_view from, std::string_view to) {
+    auto it = items.find(from);
+    if (it == items.end()) {
+        return;
+    }
+    auto item = it->second;
+    items.erase(it);
+    if (auto old = items.find(to); old != items.end()) {
+        itemKeys.erase(old->second);
+        items.erase(old);
+    }
+    auto moved = items.emplace(std::pmr::string(to), item).first;
+    itemKeys[item] = &moved->first;
+}
+
+void RoomData::removeItems(std::string_view key) {
+    std::erase_if(items, [&](const auto &entry) {
+        std::string_view itemKey = entry.first;
+        bool removed = itemKey == key ||
+                       (itemKey.starts_with(key) && itemKey.size() > key.size() && itemKey[key.size()] == '/');
+        if (removed) {
+            itemKeys.erase(entry.second);
+        }
+        return removed;
+    });
+}
+
+Room::Room(RoomData* data) : data(data) {}
+
+EntityHandle Room::handle() const {
+    return {EntityHandle::Room{data}};
 }
 
 void Notes::createFile(const std::string &name) {
@@ -199,14 +618,15 @@ void Notes::createFile(const std::string &name) {
     NoteContent me;
     me.first = name;
     me.second = {};
-    myRoom->myBaskets[this->name].push_back(me);
+    myRoom->addItem(RoomData::itemKey(this->name, name));
+    myRoom->basket(this->name).push_back(me);
 }
 
 void Notes::deleteFile(const std::string &name) {
-    auto &notes = myRoom->myBaskets[this->name];
+    auto &notes = myRoom->basket(this->name);
     int id = -1;
     for (int i = 0; i < notes.size(); ++i) {
-        if (notes[i].first == name) {
+        if (notes[i].first == std::string_view(name)) {
             id = i;
         }
     }
@@ -214,26 +634,13 @@ void Notes::deleteFile(const std::string &name) {
         throwError(std::errc::invalid_argument);
     } else {
         notes.erase(notes.begin() + id);
+        myRoom->removeItems(RoomData::itemKey(this->name, name));
     }
 }
 
-std::vector<std::string> Shelf::getContents() {
-    return myRoom->shelfToBook.at(this->name);
-}
-
-Entity::ptr Shelf::get(const std::string &name) {
-    auto &book_names = myRoom->shelfToBook.at(this->name);
-    for (const auto &kek: book_names) {
-        if (kek == name) {
-            return std::make_unique<Book>(name, myRoom, this->name);
-        }
-    }
-    return nullptr;
-}
-
 void Shelf::move(Entity &to, const std::string&) {
     auto bc = dynamic_cast<Bookcase *>(&to);
-    if (bc != nullptr && name.starts_with(bc->name)) {
+    if (bc != nullptr && bc->myRoom == myRoom && shelf / BabylonFS::getGeometry().shelves == bc->bookcase) {
         // do nothing
     } else {
         throwError(std::errc::invalid_argument);
@@ -249,28 +656,6 @@ void Bookcase::move(Entity &to, const std::string&) {
     }
 }
 
-Entity::ptr Desk::get(const std::string &name) {
-    if (myRoom->myBaskets.contains(name)) {
-        return std::make_unique<Notes>(name, myRoom);
-    }
-
-    for (size_t i = 0; i < myRoom->myNotes.size(); ++i) {
-        if (myRoom->myNotes[i].first == name) {
-            return std::make_unique<Note>(name, i, myRoom, false, "");
-        }
-    }
-
-    for (const auto &kek: myRoom->takenBooks) {
-        for (const auto &kek2: kek.second) {
-            if (kek2 == name) {
-                return std::make_unique<Book>(name, myRoom, kek.first);
-            }
-        }
-    }
-    
-    return nullptr;
-}
-
 void Desk::createFile(const std::string &name) {
     auto contents = getContents();
     std::cout << contents.size();
@@ -281,6 +666,7 @@ void Desk::createFile(const std::string &name) {
     NoteContent me;
     me.first = name;
     me.second = {};
+    myRoom->addItem(name);
     myRoom->myNotes.push_back(me);
 }
 
@@ -288,7 +674,7 @@ void Desk::deleteFile(const std::string &name) {
     auto &notes = myRoom->myNotes;
     int id = -1;
     for (int i = 0; i < notes.size(); ++i) {
-        if (notes[i].first == name) {
+        if (notes[i].first == std::string_view(name)) {
             id = i;
         }
     }
@@ -296,13 +682,15 @@ void Desk::deleteFile(const std::string &name) {
         throwError(std::errc::invalid_argument);
     } else {
         notes.erase(notes.begin() + id);
+        myRoom->removeItems(name);
     }
 }
 
 void Desk::deleteDirectory(const std::string &name) {
     auto &notes = myRoom->myBaskets;
-    if (notes.contains(name)) {
-        notes.erase(name);
+    if (auto it = notes.find(std::string_view(name)); it != notes.end()) {
+        notes.erase(it);
+        myRoom->removeItems(name);
     } else {
         throwError(std::errc::invalid_argument);
     }
@@ -310,10 +698,10 @@ void Desk::deleteDirectory(const std::string &name) {
 
 std::string_view Note::getContents() {
     if (!isBasket) {
-        std::vector<NoteContent>& notes = myRoom->myNotes;
+        auto& notes = myRoom->myNotes;
         return notes[id].second;
     } else {
-        std::vector<NoteContent>& notes = myRoom->myBaskets.at(basketName);
+        auto& notes = myRoom->basket(basketName);
         return notes[id].second;
     }
 }
@@ -325,7 +713,7 @@ void Note::move(Entity &to, const std::string& newName) {
         me = notes[id];
         notes.erase(notes.begin() + id);
     } else {
-        auto& notes = myRoom->myBaskets.at(basketName);
+        auto& notes = myRoom->basket(basketName);
         me = notes[id];
         notes.erase(notes.begin() + id);
     }
@@ -334,13 +722,15 @@ void Note::move(Entity &to, const std::string& newName) {
         if (myRoom != kek->myRoom) {
             throwError(std::errc::invalid_argument);
         }
-        this->myRoom->myBaskets[kek->name].push_back({newName, me.second});
+        this->myRoom->basket(kek->name).emplace_back(newName, me.second);
+        myRoom->moveItem(RoomData::itemKey(isBasket ? basketName : "", name), RoomData::itemKey(kek->name, newName));
     } else if (dynamic_cast<Desk *>(&to) != nullptr) {
         auto kek = dynamic_cast<Desk *>(&to);
         if (myRoom != kek->myRoom) {
             throwError(std::errc::invalid_argument);
         }
-        this->myRoom->myNotes.push_back({newName, me.second});
+        this->myRoom->myNotes.emplace_back(newName, me.second);
+        myRoom->moveItem(RoomData::itemKey(isBasket ? basketName : "", name), newName);
     }
 }
 
@@ -348,10 +738,14 @@ bool Note::isWriteable() {
     return true;
 }
 
+EntityHandle Note::handle() const {
+    return {EntityHandle::Note{myRoom, isBasket ? std::string_view(basketName) : std::string_view(), id}};
+}
+
 void Note::write(const char *buf, size_t size, off_t offset) {
 
     if (!isBasket) {
-        std::vector<NoteContent> &notes = myRoom->myNotes;
+        auto &notes = myRoom->myNotes;
 
         auto& me = notes[id];
 
@@ -363,7 +757,7 @@ void Note::write(const char *buf, size_t size, off_t offset) {
             me.second[offset + i] = buf[i];
         }
     } else {
-        std::vector<NoteContent> &notes = myRoom->myBaskets.at(basketName);
+        auto &notes = myRoom->basket(basketName);
 
         auto& me = notes[id];
 
@@ -377,11 +771,220 @@ void Note::write(const char *buf, size_t size, off_t offset) {
     }
 }
 
-RoomStorage::RoomStorage(int cycle) : cycle(cycle) {}
+RoomArena::RoomArena() : chunks(&heap), pool({0, largeBlock}, &chunks) {}
+
+uint64_t RoomArena::allocations() const {
+    return count;
+}
+
+uint64_t RoomArena::heapAllocations() const {
+    return heap.count;
+}
+
+uint64_t RoomArena::largeBytes() const {
+    return large.bytes;
+}
+
+void *RoomArena::do_allocate(size_t bytes, size_t alignment) {
+    ++count;
+    if (bytes > largeBlock) {
+        return large.allocate(bytes, alignment);
+    }
+    return pool.allocate(bytes, alignment);
+}
+
+void RoomArena::do_deallocate(void *p, size_t bytes, size_t alignment) {
+    if (bytes > largeBlock) {
+        large.deallocate(p, bytes, alignment);
+    } else {
+        pool.deallocate(p, bytes, alignment);
+    }
+}
+
+bool RoomArena::do_is_equal(const std::pmr::memory_resource &other) const noexcept {
+    return this == &other;
+}
+
+void *RoomArena::CountingResource::do_allocate(size_t bytes, size_t alignment) {
+    ++count;
+    this->bytes += bytes;
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+}
+
+void RoomArena::CountingResource::do_deallocate(void *p, size_t bytes, size_t alignment) {
+    this->bytes -= bytes;
+    std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+}
+
+bool RoomArena::CountingResource::do_is_equal(const std::pmr::memory_resource &other) const noexcept {
+    return this == &other;
+}
+
+namespace {
+
+// Rooms got by the operation running on this thread
+struct OperationRooms {
+    RoomStorage *storage = nullptr;
+    int depth = 0;
+    std::vector<int> rooms;
+};
+
+thread_local OperationRooms currentOperation;
+
+}
+
+const size_t RoomStorage::roomFootprint = sizeof(RoomData) + sizeof(Entry) + 64;
+
+RoomStorage::RoomStorage(int cycle, size_t maxRooms, int prefetchDepth, bool prefetchNames) :
+    cycle(cycle), maxRooms(maxRooms), prefetchDepth(prefetchDepth), prefetchNames(prefetchNames) {}
 
 RoomData* RoomStorage::getRoom(int n) {
-    if (rooms[n]) return rooms[n].get();
-    auto retval = (rooms[n] = std::make_unique<RoomData>(n, cycle)).get();
-    retval->storage = this;
-    return retval;
+    std::lock_guard lock(mutex);
+    auto it = rooms.find(n);
+    bool added = it == rooms.end();
+    if (added) {
+        auto room = std::make_unique<RoomData>(n, cycle);
+        room->storage = this;
+        it = rooms.emplace(n, Entry{std::move(room), recent.insert(recent.begin(), n), true}).first;
+    } else if (it->second.listed) {
+        recent.splice(recent.begin(), recent, it->second.position);
+    } else if (maxRooms != 0 && it->second.users == 0 && it->second.room->isPristine()) {
+        // changes were undone, the room can go again
+        it->second.position = recent.insert(recent.begin(), n);
+        it->second.listed = true;
+    }
+
+    auto *room = it->second.room.get();
+    if (currentOperation.storage == this) {
+        ++it->second.users;
+        currentOperation.rooms.push_back(n);
+    }
+    if (added && maxRooms != 0) {
+        evict(room);
+    }
+    return room;
+}
+
+void RoomStorage::evict(const RoomData *keep) {
+    for (auto it = recent.end(); rooms.size() > maxRooms && it != recent.begin();) {
+        --it;
+        auto &entry = rooms.find(*it)->second;
+        if (entry.users > 0 || entry.room.get() == keep) {
+            continue;
+        }
+        // no operation holds the room, so nothing changes it while it is checked
+        auto n = *it;
+        it = recent.erase(it);
+        if (!entry.room->isPristine()) {
+            entry.listed = false;
+            continue;
+        }
+        rooms.erase(n);
+        ++evictions;
+    }
+}
+
+void RoomStorage::prefetchAround(int n) {
+    auto &pool = BabylonFS::getPool();
+    if (prefetchDepth <= 0 || pool.size() == 0) {
+        return;
+    }
+    if (++prefetchTasks > maxPrefetchTasks) {
+        --prefetchTasks;
+        ++prefetchSkipped;
+        return;
+    }
+    pool.submit([this, n] {
+        std::vector<int> visited{n};
+        std::vector<int> frontier{n};
+        bool full = false;
+        for (int depth = 0; depth < prefetchDepth && !frontier.empty() && !full; ++depth) {
+            std::vector<int> next;
+            for (size_t i = 0; i < frontier.size() && !full; ++i) {
+                auto [left, right] = RoomData::neighbours(frontier[i], cycle);
+                for (int neighbour : {left, right}) {
+                    if (std::find(visited.begin(), visited.end(), neighbour) != visited.end()) {
+                        continue;
+                    }
+                    visited.push_back(neighbour);
+                    next.push_back(neighbour);
+                    if (contains(neighbour)) {
+                        continue;
+                    }
+                    // made apart and stored when ready, rooms FUSE calls may be changing are never touched
+                    auto prepared = std::make_unique<RoomData>(neighbour, cycle);
+                    prepared->storage = this;
+                    if (prefetchNames) {
+                        for (int shelf = 0; shelf < RoomData::shelfCount(); ++shelf) {
+                            prepared->shelfNames(shelf);
+                        }
+                    }
+                    if (!addPrepared(std::move(prepared))) {
+                        full = true;
+                        break;
+                    }
+                    ++prefetched;
+                }
+            }
+            frontier = std::move(next);
+        }
+        --prefetchTasks;
+    });
+}
+
+bool RoomStorage::contains(int n) const {
+    std::lock_guard lock(mutex);
+    return rooms.contains(n);
+}
+
+bool RoomStorage::addPrepared(std::unique_ptr<RoomData> room) {
+    std::lock_guard lock(mutex);
+    if (rooms.contains(room->n)) {
+        // visited meanwhile, that copy is the one in use
+        return true;
+    }
+    if (maxRooms != 0 && rooms.size() >= maxRooms) {
+        return false;
+    }
+    auto n = room->n;
+    rooms.emplace(n, Entry{std::move(room), recent.insert(recent.begin(), n), true});
+    return true;
+}
+
+void RoomStorage::beginOperation() {
+    if (currentOperation.depth++ == 0) {
+        currentOperation.storage = this;
+    }
+}
+
+void RoomStorage::endOperation() {
+    if (--currentOperation.depth > 0) {
+        return;
+    }
+    currentOperation.storage = nullptr;
+    // changes the operation made are published by this lock before anyone checks the rooms
+    std::lock_guard lock(mutex);
+    for (int n : currentOperation.rooms) {
+        --rooms.find(n)->second.users;
+    }
+    currentOperation.rooms.clear();
+    if (maxRooms != 0) {
+        evict();
+    }
+}
+
+RoomStorage::Stats RoomStorage::stats() const {
+    std::lock_guard lock(mutex);
+    size_t pinned = 0;
+    uint64_t arenaAllocations = 0, heapAllocations = 0;
+    for (const auto &[n, entry] : rooms) {
+        // rooms in use may be changing right now
+        if (entry.users > 0) {
+            continue;
+        }
+        pinned += !entry.room->isPristine();
+        arenaAllocations += entry.room->arena.allocations();
+        heapAllocations += entry.room->arena.heapAllocations();
+    }
+    return {rooms.size(), pinned, evictions, prefetched, prefetchSkipped, arenaAllocations, heapAllocations};
 }
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <atomic>
+#include <list>
+#include <map>
+#include <mutex>
 #include <utility>
 #include "babylonfs.h"
 
@@ -8,41 +12,73 @@ struct Bookcase;
 struct Shelf;
 struct Book;
 
+// Everything needed to generate a book text, cheap to copy into background tasks
+struct BookText {
+    const ContentEngine *engine;
+    const Alphabet *alphabet;
+    // content key, or the hash of the seed string for engines that use one
+    Key128 key;
+    std::string seed;
+
+    void generate(uint64_t offset, char *dst, size_t len) const;
+    BlockId blockId(uint64_t index) const;
+    BlockCache::Block generateBlock(uint64_t index) const;
+    // Generates a block once for all concurrent callers and caches it
+    BlockCache::Block loadBlock(uint64_t index) const;
+    // Reads through the shared block cache
+    void read(uint64_t offset, char *dst, size_t len) const;
+    // Generates the blocks of [offset, offset + size) missing from the cache on the thread pool
+    void prefetch(off_t offset, size_t size) const;
+
+    // Text of the book with this key, the name is only needed by engines that use a seed string
+    static BookText forBook(const Key128 &key, std::string_view name);
+};
+
 struct Book : public File {
     std::string name;
+    // the whole text once getContents() is called, FUSE reads never need it
     std::string contents;
 
-    explicit Book(const std::string &name, RoomData *myRoom, std::string shelf_name);
+    explicit Book(std::string_view name, RoomData *myRoom, int shelf, int slot);
     std::string_view getContents() override;
-    int getSize() override;
+    void readInto(char *dst, size_t size, off_t offset) override;
+    off_t getSize() override;
+    void prefetch(off_t offset, size_t size) override;
     void move(Entity &to, const std::string& newName) override;
+    EntityHandle handle() const override;
 
     RoomData *myRoom;
-    std::string shelfName;
+    // place of the book in the room, which never changes when it is moved
+    int shelf;
+    int slot;
+    Key128 key;
+
+private:
+    BookText text() const;
 };
 
 struct Shelf : public Directory {
-    explicit Shelf(std::string name, RoomData* myRoom);
+    explicit Shelf(std::string name, RoomData* myRoom, int shelf);
     void move(Entity &to, const std::string& newName) override;
-    std::vector<std::string> getContents() override;
-    ptr get(const std::string &name) override;
+    EntityHandle handle() const override;
 
     RoomData* myRoom;
+    // index over all shelves of the room, bookcase * shelves + shelf
+    int shelf;
 };
 
 struct Bookcase : Directory {
-    Bookcase(std::string name, RoomData* myRoom);
+    Bookcase(std::string name, RoomData* myRoom, int bookcase);
     void move(Entity &to, const std::string& newName) override;
-    std::vector<std::string> getContents() override;
-    ptr get(const std::string &name) override;
+    EntityHandle handle() const override;
 
     RoomData* myRoom;
+    int bookcase;
 };
 
 struct Desk : public Directory {
     explicit Desk(RoomData* myRoom);
-    std::vector<std::string> getContents() override;
-    ptr get(const std::string &name) override;
+    EntityHandle handle() const override;
     void createFile(const std::string &name) override;
     void deleteFile(const std::string &name) override;
     void createDirectory(const std::string &name) override;
@@ -54,8 +90,7 @@ struct Desk : public Directory {
 
 struct Notes : public Directory {
     Notes(std::string name, RoomData* myRoom);
-    std::vector<std::string> getContents() override;
-    ptr get(const std::string &name) override;
+    EntityHandle handle() const override;
     void createFile(const std::string &name) override;
     void deleteFile(const std::string &name) override;
 
@@ -69,6 +104,7 @@ public:
     void write(const char *buf, size_t size, off_t offset) override;
     void move(Entity &to, const std::string& newName) override;
     bool isWriteable() override;
+    EntityHandle handle() const override;
 
     int id;
     bool isBasket;
@@ -78,33 +114,203 @@ public:
 
 struct RoomStorage;
 
+// Lets maps keyed by strings be searched with any string
+struct NameHash {
+    using is_transparent = void;
+
+    size_t operator()(std::string_view name) const noexcept {
+        return std::hash<std::string_view>{}(name);
+    }
+};
+
+// Book names of one shelf in slot order with a reverse index. Tables are
+// shared by all rooms with the same shelf; the least recently used ones are
+// dropped beyond a bound that keepNames() can raise.
+struct NameTable {
+    std::vector<std::string> names;
+    std::unordered_map<std::string, int, NameHash, std::equal_to<>> slots;
+
+    // Slot of the book with this name, -1 if there is none
+    int find(std::string_view name) const;
+};
+
+// Allocator of one room's containers. Small blocks are recycled in a pool
+// carved from chunks that are only given back when the room is destroyed,
+// large ones are taken from the heap and given back as soon as they are freed.
+class RoomArena : public std::pmr::memory_resource {
+public:
+    RoomArena();
+
+    // allocations made by the containers
+    uint64_t allocations() const;
+    // chunks the arena itself took from the heap for them
+    uint64_t heapAllocations() const;
+    // bytes of large blocks not given back yet, they are taken from the heap one by one
+    uint64_t largeBytes() const;
+
+private:
+    class CountingResource : public std::pmr::memory_resource {
+    public:
+        uint64_t count = 0;
+        uint64_t bytes = 0;
+
+    private:
+        void *do_allocate(size_t bytes, size_t alignment) override;
+        void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+        bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+    };
+
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+
+    // larger blocks bypass the pool, its chunks would keep them until the room goes
+    static const size_t largeBlock = 4096;
+
+    CountingResource heap;
+    CountingResource large;
+    std::pmr::monotonic_buffer_resource chunks;
+    std::pmr::unsynchronized_pool_resource pool;
+    uint64_t count = 0;
+};
+
 struct RoomData {
+    using Basket = std::pmr::vector<NoteContent>;
+
     RoomData(int n, int cycle);
 
+    // Number of shelves in a room over all bookcases
+    static int shelfCount();
+
+    // Numbers of the rooms left and right of room n
+    static std::pair<int, int> neighbours(int n, int cycle);
+
+    // Name of the shelf in legacy seed strings, "b<bookcase><shelf>", with a slash between them past ten shelves
+    static std::string shelfName(int shelf);
+
+    // Names of the books originally placed on the shelf
+    std::shared_ptr<const NameTable> shelfNames(int shelf) const;
+
+    // Lets the shared name table cache hold at least count names
+    static void keepNames(size_t count);
+
+    // Books currently on the shelf in slot order
+    std::vector<std::string> shelfBooks(int shelf) const;
+
+    bool isOnShelf(int shelf, int slot) const;
+    void takeBook(int shelf, int slot);
+    void returnBook(int shelf, int slot);
+
+    Key128 bookKey(int shelf, int slot) const;
+
+    // Notes in the basket on the desk, throws ENOENT if there is none
+    Basket &basket(std::string_view name);
+
+    // No notes or baskets were ever made and no books are taken, so the room can be regenerated from the seed
+    bool isPristine() const;
+
+    // Key of a note or basket in items: its name on the desk, "basket/name" in a basket
+    static std::string itemKey(std::string_view basket, std::string_view name);
+
+    // Numbers a new note or basket, numbers are never reused in the room;
+    // throws ENOSPC once they would not fit in an inode
+    void addItem(std::string_view key);
+    // Number of the note or basket, 0 if there is none
+    int findItem(std::string_view key) const;
+    // Key of the note or basket with this number, nullptr if there is none
+    const std::pmr::string *findItemKey(int item) const;
+    void moveItem(std::string_view from, std::string_view to);
+    // Forgets the note or basket together with the notes in it
+    void removeItems(std::string_view key);
+
+    int n;
+    Key128 key;
     int cycle;
     int leftN;
     int rightN;
-    std::unordered_map<std::string, std::vector<NoteContent>> myBaskets;
-    std::vector<NoteContent> myNotes;
-    std::unordered_map<std::string, std::vector<std::string>> takenBooks;
-    std::unordered_map<std::string, std::vector<std::string>> shelfToBook;
+    // user changes are allocated here and freed together with the room
+    RoomArena arena;
+    std::pmr::unordered_map<std::pmr::string, Basket, NameHash, std::equal_to<>> myBaskets{&arena};
+    // numbers of notes and baskets, they name them in inodes
+    std::pmr::unordered_map<std::pmr::string, int, NameHash, std::equal_to<>> items{&arena};
+    // the same numbers the other way, pointing at the keys in items
+    std::pmr::unordered_map<int, const std::pmr::string *> itemKeys{&arena};
+    Basket myNotes{&arena};
+    // shelves with books on the desk: bit i is set while the book from slot i is taken
+    std::pmr::map<int, std::pmr::vector<uint64_t>> takenBooks{&arena};
     RoomStorage *storage;
+    uint32_t lastItem = 0;
 };
 
 struct Room : public Directory {
     explicit Room(RoomData*);
 
-    std::vector<std::string> getContents() override;
-    Entity::ptr get(const std::string &name) override;
+    EntityHandle handle() const override;
 
     RoomData *data;
 };
 
 struct RoomStorage {
-    explicit RoomStorage(int cycle);
+    struct Stats {
+        size_t resident;
+        size_t pinned;
+        uint64_t evictions;
+        // rooms prepared ahead of a walk and walks not followed because of the cap
+        uint64_t prefetched;
+        uint64_t prefetchSkipped;
+        // container allocations of resident rooms and the heap allocations behind them
+        uint64_t arenaAllocations;
+        uint64_t heapAllocations;
+    };
+
+    // Approximate memory taken by one pristine room
+    static const size_t roomFootprint;
+    // Background walks running at the same time
+    static const int maxPrefetchTasks = 2;
+
+    // maxRooms == 0 keeps every room; rooms up to prefetchDepth links away
+    // from a visited one are prepared in the background
+    RoomStorage(int cycle, size_t maxRooms, int prefetchDepth = 0, bool prefetchNames = false);
     RoomData* getRoom(int n);
 
+    // Prepares the neighbourhood of room n on the thread pool, together with
+    // the shelf name tables if prefetchNames is set; the walk stops at the room limit
+    void prefetchAround(int n);
+
+    // Rooms got by the calling thread between these two stay in memory until
+    // the end, the rooms over the limit are evicted then
+    void beginOperation();
+    void endOperation();
+
+    Stats stats() const;
+
 private:
+    struct Entry {
+        std::unique_ptr<RoomData> room;
+        std::list<int>::iterator position;
+        // false once the room was found changed and taken off the eviction order
+        bool listed;
+        // operations in progress that got the room, it is neither evicted nor checked for changes meanwhile
+        int users = 0;
+    };
+
+    // Evicts unused pristine rooms beyond the limit, other than keep
+    void evict(const RoomData *keep = nullptr);
+    bool contains(int n) const;
+    // Stores a room made by a walk unless the limit is reached, never evicts
+    bool addPrepared(std::unique_ptr<RoomData> room);
+
     int cycle;
-    std::unordered_map<int, std::unique_ptr<RoomData>> rooms;
+    size_t maxRooms;
+    int prefetchDepth;
+    bool prefetchNames;
+
+    mutable std::mutex mutex;
+    std::unordered_map<int, Entry> rooms;
+    // eviction candidates, most recently used first
+    std::list<int> recent;
+    uint64_t evictions = 0;
+
+    std::atomic<int> prefetchTasks{0};
+    std::atomic<uint64_t> prefetched{0}, prefetchSkipped{0};
 };
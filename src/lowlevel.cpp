@@ -0,0 +1,317 @@
+#include <fuse_lowlevel.h>
+#include <algorithm>
+#include <iostream>
+#include <system_error>
+#include <vector>
+
+#include "babylonfs.h"
+
+namespace {
+
+// seconds the kernel may keep entries and attributes, the same as the high-level library
+const double entryTimeout = 1.0;
+
+// inode reported in directory listings, the kernel looks entries up before using them
+const fuse_ino_t unknownInode = 0xffffffff;
+
+// Listing of a directory taken on opendir and handed out in slices by readdir
+struct DirectoryListing {
+    // typical listings fit without growing, a shelf of 32 books takes about 1.5 KiB
+    static const size_t initialSize = 4096;
+
+    fuse_req_t req;
+    std::vector<char> entries;
+
+    explicit DirectoryListing(fuse_req_t req) : req(req) {
+        entries.reserve(initialSize);
+    }
+
+    void add(const char *name) {
+        struct stat st{};
+        st.st_ino = unknownInode;
+        auto offset = entries.size();
+        auto size = fuse_add_direntry(req, nullptr, 0, name, nullptr, 0);
+        entries.resize(offset + size);
+        fuse_add_direntry(req, entries.data() + offset, size, name, &st, offset + size);
+    }
+};
+
+Directory &asDirectory(const Entity::ptr &entity) {
+    auto *dir = dynamic_cast<Directory *>(entity.get());
+    if (!dir) {
+        throwError(std::errc::not_a_directory);
+    }
+    return *dir;
+}
+
+File &asFile(const Entity::ptr &entity) {
+    auto *file = dynamic_cast<File *>(entity.get());
+    if (!file) {
+        throwError(std::errc::is_a_directory);
+    }
+    return *file;
+}
+
+const EntityHandle &asDirectory(const EntityHandle &entity) {
+    if (!entity.isDirectory()) {
+        throwError(std::errc::not_a_directory);
+    }
+    return entity;
+}
+
+Entity::ptr getChild(Directory &dir, const char *name) {
+    auto child = dir.get(name);
+    if (!child) {
+        throwError(std::errc::no_such_file_or_directory);
+    }
+    return child;
+}
+
+EntityHandle getChild(const EntityHandle &dir, const char *name) {
+    auto child = asDirectory(dir).get(name);
+    if (!child) {
+        throwError(std::errc::no_such_file_or_directory);
+    }
+    return *child;
+}
+
+}
+
+EntityHandle BabylonFS::findInode(uint64_t id) {
+    auto ino = id;
+    if (InodeTable::isDynamic(id)) {
+        auto node = inodes->get(id);
+        ino = node ? node->inode : 0;
+    }
+    auto entity = resolveInode(ino);
+    if (!entity) {
+        throwError(std::errc::no_such_file_or_directory);
+    }
+    return *entity;
+}
+
+Entity::ptr BabylonFS::getInode(uint64_t id) {
+    return findInode(id).entity();
+}
+
+struct fuse_entry_param BabylonFS::makeEntry(uint64_t parent, std::string_view name, const EntityHandle &entity) {
+    struct fuse_entry_param entry{};
+    statEntity(entity, &entry.attr);
+    entry.ino = entry.attr.st_ino;
+    if (entity.isDirectory()) {
+        entry.ino = inodes->lookup(parent, name, entry.attr.st_ino);
+    }
+    entry.attr_timeout = entryTimeout;
+    entry.entry_timeout = entryTimeout;
+    return entry;
+}
+
+std::unique_ptr<struct fuse_lowlevel_ops> BabylonFS::makeLowLevelOps() {
+    auto ops = std::make_unique<struct fuse_lowlevel_ops>();
+
+    ops->init = [](void *, struct fuse_conn_info *) {
+        instance().onInit();
+    };
+
+    ops->destroy = [](void *) {
+        auto &me = instance();
+        me.onDestroy();
+        auto stats = me.inodes->stats();
+        std::cerr << "babylonfs: " << stats.nodes << " inodes in use, " << stats.lookups << " lookups, "
+                  << stats.forgotten << " forgotten" << std::endl;
+    };
+
+    ops->lookup = [](fuse_req_t req, fuse_ino_t parent, const char *name) {
+        Operation operation;
+        try {
+            auto &me = instance();
+            auto entry = me.makeEntry(parent, name, getChild(me.findInode(parent), name));
+            fuse_reply_entry(req, &entry);
+        } catch (std::system_error &e) {
+            fuse_reply_err(req, e.code().value());
+        }
+    };
+
+    ops->forget = [](fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+        instance().inodes->forget(ino, nlookup);
+        fuse_reply_none(req);
+    };
+
+    ops->getattr = [](fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *) {
+        Operation operation;
+        try {
+            struct stat st{};
+            statEntity(instance().findInode(ino), &st);
+            fuse_reply_attr(req, &st, entryTimeout);
+        } catch (std::system_error &e) {
+            fuse_reply_err(req, e.code().value());
+        }
+    };
+
+    ops->opendir = [](fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+        Operation operation;
+        try {
+            auto dir = asDirectory(instance().findInode(ino));
+
+            auto listing = std::make_unique<DirectoryListing>(req);
+            listing->add(".");
+            listing->add("..");
+            dir.list(listing.get(), [](void *context, const char *name) {
+                static_cast<DirectoryListing *>(context)->add(name);
+            });
+            fi->fh = reinterpret_cast<uint64_t>(listing.release());
+            fuse_reply_open(req, fi);
+        } catch (std::system_error &e) {
+            fuse_reply_err(req, e.code().value());
+        }
+    };
+
+    ops->readdir = [](fuse_req_t req, fuse_ino_t, size_t size, off_t offset, struct fuse_file_info *fi) {
+        auto &entries = reinterpret_cast<DirectoryListing *>(fi->fh)->entries;
+        if (offset >= off_t(entries.size())) {
+            fuse_reply_buf(req, nullptr, 0);
+            return;
+        }
+        fuse_reply_buf(req, entries.data() + offset, std::min(size, entries.size() - offset));
+    };
+
+    ops->releasedir = [](fuse_req_t req, fuse_ino_t, struct fuse_file_info *fi) {
+        delete reinterpret_cast<DirectoryListing *>(fi->fh);
+        fi->fh = 0;
+        fuse_reply_err(req, 0);
+    };
+
+    ops->open = [](fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+        Operation operation;
+        try {
+            auto entity = instance().getInode(ino);
+            auto &file = asFile(entity);
+
+            if ((fi->flags & O_ACCMODE) != O_RDONLY && !file.isWriteable()) {
+                throwError(std::errc::permission_denied);
+            }
+
+            fi->fh = reinterpret_cast<uint64_t>(instance().makeReadahead(file.handle()));
+            fuse_reply_open(req, fi);
+        } catch (std::system_error &e) {
+            fuse_reply_err(req, e.code().value());
+        }
+    };
+
+    ops->release = [](fuse_req_t req, fuse_ino_t, struct fuse_file_info *fi) {
+        delete reinterpret_cast<Readahead *>(fi->fh);
+        fi->fh = 0;
+        fuse_reply_err(req, 0);
+    };
+
+    ops->read = [](fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+        Operation operation;
+        try {
+            auto file = instance().findInode(ino);
+            auto len = file.getSize();
+            if (offset < len) {
+                if (len - offset < off_t(size)) {
+                    size = len - offset;
+                }
+            } else {
+                size = 0;
+            }
+
+            // reused by the requests of one FUSE thread
+            thread_local std::vector<char> buffer;
+            if (buffer.size() < size) {
+                buffer.resize(size);
+            }
+            readFile(file, reinterpret_cast<Readahead *>(fi->fh), buffer.data(), size, offset);
+            fuse_reply_buf(req, buffer.data(), size);
+        } catch (std::system_error &e) {
+            fuse_reply_err(req, e.code().value());
+        }
+    };
+
+    ops->write = [](fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset,
+                    struct fuse_file_info *) {
+        Operation operation;
+        try {
+            auto entity = instance().getInode(ino);
+            asFile(entity).write(buf, size, offset);
+            fuse_reply_write(req, size);
+        } catch (std::system_error &e) {
+            fuse_reply_err(req, e.code().value());
+        }
+    };
+
+    ops->create = [](fuse_req_t req, fuse_ino_t parent, const char *name, mode_t, struct fuse_file_info *fi) {
+        Operation operation;
+        try {
+            auto &me = instance();
+            auto entity = me.getInode(parent);
+            auto &dir = asDirectory(entity);
+
+            dir.createFile(name);
+            auto entry = me.makeEntry(parent, name, getChild(dir.handle(), name));
+            // only notes are created, they have nothing to read ahead
+            fi->fh = 0;
+            fuse_reply_create(req, &entry, fi);
+        } catch (std::system_error &e) {
+            fuse_reply_err(req, e.code().value());
+        }
+    };
+
+    ops->mkdir = [](fuse_req_t req, fuse_ino_t parent, const char *name, mode_t) {
+        Operation operation;
+        try {
+            auto &me = instance();
+            auto entity = me.getInode(parent);
+            auto &dir = asDirectory(entity);
+
+            dir.createDirectory(name);
+            auto entry = me.makeEntry(parent, name, getChild(dir.handle(), name));
+            fuse_reply_entry(req, &entry);
+        } catch (std::system_error &e) {
+            fuse_reply_err(req, e.code().value());
+        }
+    };
+
+    ops->unlink = [](fuse_req_t req, fuse_ino_t parent, const char *name) {
+        Operation operation;
+        try {
+            auto &me = instance();
+            asDirectory(me.getInode(parent)).deleteFile(name);
+            me.inodes->remove(parent, name);
+            fuse_reply_err(req, 0);
+        } catch (std::system_error &e) {
+            fuse_reply_err(req, e.code().value());
+        }
+    };
+
+    ops->rmdir = [](fuse_req_t req, fuse_ino_t parent, const char *name) {
+        Operation operation;
+        try {
+            auto &me = instance();
+            asDirectory(me.getInode(parent)).deleteDirectory(name);
+            me.inodes->remove(parent, name);
+            fuse_reply_err(req, 0);
+        } catch (std::system_error &e) {
+            fuse_reply_err(req, e.code().value());
+        }
+    };
+
+    ops->rename = [](fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newParent,
+                     const char *newName) {
+        Operation operation;
+        try {
+            auto &me = instance();
+            auto entity = getChild(asDirectory(me.getInode(parent)), name);
+            auto target = me.getInode(newParent);
+
+            entity->move(asDirectory(target), newName);
+            me.inodes->move(parent, name, newParent, newName);
+            fuse_reply_err(req, 0);
+        } catch (std::system_error &e) {
+            fuse_reply_err(req, e.code().value());
+        }
+    };
+
+    return ops;
+}
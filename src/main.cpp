@@ -1,10 +1,33 @@
 #include "babylonfs.h"
+#include "util.h"
 #include <cstddef>
+#include <cstdint>
+#include <cstdlib>
 #include <iostream>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <string_view>
 
 struct Options {
     const char* seed = nullptr;
+    const char* frontend = nullptr;
+    const char* generator = nullptr;
+    const char* alphabet = nullptr;
+    int threads = -1;
+    const char* contentCache = nullptr;
+    const char* readahead = nullptr;
+    int pathCache = 64 * 1024;
+    const char* bookSize = nullptr;
+    int bookcases = 4;
+    int shelves = 5;
+    int booksPerShelf = 32;
+    int maxRooms = 0;
+    const char* roomMemory = nullptr;
+    int prefetchRooms = 0;
+    bool prefetchNames = false;
+    bool prewarm = false;
+    int prewarmContent = 0;
+    bool prewarmWait = false;
     bool showHelp = false;
     int cycle = -1;
 };
@@ -14,11 +37,58 @@ struct Options {
 static const struct fuse_opt optionsSpec[] = {
     OPTION("--seed=%s", seed),
     OPTION("--cycle=%d", cycle),
+    OPTION("--frontend=%s", frontend),
+    OPTION("--generator=%s", generator),
+    OPTION("--alphabet=%s", alphabet),
+    OPTION("--threads=%d", threads),
+    OPTION("--content-cache=%s", contentCache),
+    OPTION("--readahead=%s", readahead),
+    OPTION("--path-cache=%d", pathCache),
+    OPTION("--book-size=%s", bookSize),
+    OPTION("--bookcases=%d", bookcases),
+    OPTION("--shelves=%d", shelves),
+    OPTION("--books-per-shelf=%d", booksPerShelf),
+    OPTION("--max-rooms=%d", maxRooms),
+    OPTION("--room-memory=%s", roomMemory),
+    OPTION("--prefetch-rooms=%d", prefetchRooms),
+    OPTION("--prefetch-names", prefetchNames),
+    OPTION("--prewarm", prewarm),
+    OPTION("--prewarm-content=%d", prewarmContent),
+    OPTION("--prewarm-wait", prewarmWait),
     OPTION("-h", showHelp),
     OPTION("--help", showHelp),
     FUSE_OPT_END
 };
 
+// Serves the library through the inode based FUSE interface
+static int runLowLevel(struct fuse_args *args) {
+    char *mountpoint = nullptr;
+    int multithreaded = 0;
+    int foreground = 0;
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) {
+        return 1;
+    }
+
+    int err = -1;
+    if (auto *chan = fuse_mount(mountpoint, args)) {
+        auto *ops = BabylonFS::getLowLevelOps();
+        if (auto *session = fuse_lowlevel_new(args, ops, sizeof(*ops), nullptr)) {
+            if (fuse_set_signal_handlers(session) != -1) {
+                fuse_session_add_chan(session, chan);
+                if (fuse_daemonize(foreground) != -1) {
+                    err = multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session);
+                }
+                fuse_remove_signal_handlers(session);
+                fuse_session_remove_chan(chan);
+            }
+            fuse_session_destroy(session);
+        }
+        fuse_unmount(mountpoint, chan);
+    }
+    free(mountpoint);
+    return err ? 1 : 0;
+}
+
 int main(int argc, char **argv) {
     Options options;
 
@@ -37,11 +107,173 @@ int main(int argc, char **argv) {
         std::cout << R"(BabylonFS specific options:
     --seed=SEED         Seed for the random generator
     --cycle=CYCLE       Walk in circles!
+    --frontend=NAME     FUSE interface: high-level (default), addressing
+                        entities by full path, or low-level, by inode
+    --generator=NAME    Book content generator: legacy-mt19937 (default),
+                        xoshiro256, splitmix64, philox or aes-ctr
+    --alphabet=SYMBOLS  Symbols of book texts, up to 256 bytes, or
+                        "binary" for raw generator output; needs a
+                        generator other than legacy-mt19937
+    --threads=N         Threads generating large reads (default: one
+                        per core, 0 generates on the FUSE thread)
+    --content-cache=SIZE
+                        Memory for generated book blocks, K/M/G
+                        suffixes allowed (default: 64M, 0 disables)
+    --readahead=SIZE    Largest window generated ahead of sequential
+                        reads (default: 2M, 0 disables)
+    --path-cache=N      Resolved paths remembered, so deep paths are not
+                        walked from the root every time (default: 65536,
+                        0 disables)
+    --book-size=SIZE    Size of every book, K/M/G suffixes allowed
+                        (default: 1M)
+    --bookcases=N       Bookcases in a room (default: 4)
+    --shelves=N         Shelves in a bookcase (default: 5)
+    --books-per-shelf=N Books on a shelf (default: 32)
+    --max-rooms=N       Rooms kept in memory, unchanged rooms beyond it
+                        are dropped and regenerated (default: 0, no limit)
+    --room-memory=SIZE  Same limit expressed in bytes (default: 0, no limit)
+    --prefetch-rooms=DEPTH
+                        Prepare rooms up to DEPTH links ahead of a walk
+                        in the background (default: 0, off)
+    --prefetch-names    Also generate the book names of those rooms
+    --prewarm           With --cycle, generate the book names of every
+                        room on all cores right after mounting
+    --prewarm-content=PERCENT
+                        Share of books per shelf whose text is generated
+                        into the content cache on prewarm (default: 0)
+    --prewarm-wait      Answer requests only after prewarm has finished
+                        (default: serve immediately, warm in background)
 
 )";
     }
 
-    int exitCode = fuse_main(args.argc, args.argv, BabylonFS::run(options.seed, options.cycle), nullptr);
+    bool lowLevel = false;
+    if (options.frontend != nullptr) {
+        std::string_view frontend = options.frontend;
+        if (frontend == "low-level") {
+            lowLevel = true;
+        } else if (frontend != "high-level") {
+            std::cerr << "Unknown frontend: " << options.frontend << std::endl;
+            fuse_opt_free_args(&args);
+            return 1;
+        }
+    }
+
+    BabylonFS::Settings settings;
+    settings.threads = options.threads;
+    if (options.generator != nullptr) {
+        settings.engine = ContentEngine::find(options.generator);
+        if (settings.engine == nullptr) {
+            std::cerr << "Unknown generator: " << options.generator << std::endl;
+            fuse_opt_free_args(&args);
+            return 1;
+        }
+    }
+    if (options.alphabet != nullptr) {
+        auto alphabet = Alphabet::parse(options.alphabet);
+        if (!alphabet) {
+            std::cerr << "Invalid alphabet: " << options.alphabet << std::endl;
+            fuse_opt_free_args(&args);
+            return 1;
+        }
+        if (!alphabet->isStandard() && !settings.engine->supportsAlphabets()) {
+            std::cerr << "Generator " << settings.engine->name() << " only supports the standard alphabet" << std::endl;
+            fuse_opt_free_args(&args);
+            return 1;
+        }
+        settings.alphabet = *alphabet;
+    }
+    if (options.contentCache != nullptr) {
+        if (auto size = parseSize(options.contentCache)) {
+            settings.contentCache = *size;
+        } else {
+            std::cerr << "Invalid content cache size: " << options.contentCache << std::endl;
+            fuse_opt_free_args(&args);
+            return 1;
+        }
+    }
+    if (options.readahead != nullptr) {
+        if (auto size = parseSize(options.readahead)) {
+            settings.readahead = *size;
+        } else {
+            std::cerr << "Invalid readahead size: " << options.readahead << std::endl;
+            fuse_opt_free_args(&args);
+            return 1;
+        }
+    }
+
+    if (options.pathCache < 0) {
+        std::cerr << "Invalid path cache size: " << options.pathCache << std::endl;
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    settings.pathCache = options.pathCache;
+
+    if (options.bookSize != nullptr) {
+        auto size = parseSize(options.bookSize);
+        if (!size || *size == 0 || *size > uint64_t(INT64_MAX)) {
+            std::cerr << "Invalid book size: " << options.bookSize << std::endl;
+            fuse_opt_free_args(&args);
+            return 1;
+        }
+        settings.geometry.bookSize = *size;
+    }
+    // every book of a room needs a number of its own in the inodes
+    if (options.bookcases <= 0 || options.shelves <= 0 || options.booksPerShelf <= 0 ||
+        uint64_t(options.bookcases) * options.shelves * options.booksPerShelf > InodeCodec::maxNumber) {
+        std::cerr << "Invalid library geometry: " << options.bookcases << " bookcases, " << options.shelves
+                  << " shelves, " << options.booksPerShelf << " books per shelf" << std::endl;
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    settings.geometry.bookcases = options.bookcases;
+    settings.geometry.shelves = options.shelves;
+    settings.geometry.booksPerShelf = options.booksPerShelf;
+
+    if (options.maxRooms < 0) {
+        std::cerr << "Invalid room limit: " << options.maxRooms << std::endl;
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    settings.maxRooms = options.maxRooms;
+    if (options.roomMemory != nullptr) {
+        if (auto size = parseSize(options.roomMemory)) {
+            settings.roomMemory = *size;
+        } else {
+            std::cerr << "Invalid room memory size: " << options.roomMemory << std::endl;
+            fuse_opt_free_args(&args);
+            return 1;
+        }
+    }
+
+    if (options.prefetchRooms < 0) {
+        std::cerr << "Invalid prefetch depth: " << options.prefetchRooms << std::endl;
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    settings.prefetchRooms = options.prefetchRooms;
+    settings.prefetchNames = options.prefetchNames;
+    if (options.prewarm && options.cycle <= 0) {
+        std::cerr << "--prewarm needs --cycle" << std::endl;
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    if (options.prewarmContent < 0 || options.prewarmContent > 100) {
+        std::cerr << "Invalid prewarm content share: " << options.prewarmContent << std::endl;
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    settings.prewarm = options.prewarm;
+    settings.prewarmContent = options.prewarmContent;
+    settings.prewarmWait = options.prewarmWait;
+
+    auto *ops = BabylonFS::run(options.seed, options.cycle, settings);
+    if (!lowLevel) {
+        // report the inodes of the library instead of the ones libfuse makes up
+        fuse_opt_add_arg(&args, "-ouse_ino");
+    }
+    // help is printed by the high-level library together with its own options
+    int exitCode = lowLevel && !options.showHelp ? runLowLevel(&args) : fuse_main(args.argc, args.argv, ops, nullptr);
     fuse_opt_free_args(&args);
     return exitCode;
 }
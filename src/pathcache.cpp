@@ -0,0 +1,78 @@
+#include "pathcache.h"
+
+PathCache::PathCache(size_t capacity) : capacity(capacity) {}
+
+std::pair<size_t, std::optional<Locator>> PathCache::find(std::string_view path) {
+    std::lock_guard lock(mutex);
+    if (capacity == 0) {
+        return {0, std::nullopt};
+    }
+    for (auto prefix = path; !prefix.empty(); prefix = prefix.substr(0, prefix.rfind('/'))) {
+        if (auto it = paths.find(prefix); it != paths.end()) {
+            if (prefix.size() == path.size()) {
+                ++hits;
+            } else {
+                ++prefixHits;
+            }
+            recent.splice(recent.begin(), recent, it->second.position);
+            return {prefix.size(), it->second.locator};
+        }
+    }
+    ++misses;
+    return {0, std::nullopt};
+}
+
+uint64_t PathCache::generation() const {
+    std::lock_guard lock(mutex);
+    return currentGeneration;
+}
+
+void PathCache::put(std::string_view path, const Locator &locator, uint64_t generation) {
+    std::lock_guard lock(mutex);
+    if (capacity == 0 || generation != currentGeneration) {
+        return;
+    }
+    auto [it, inserted] = paths.try_emplace(std::string(path), Entry{locator, {}});
+    if (!inserted) {
+        it->second.locator = locator;
+        recent.splice(recent.begin(), recent, it->second.position);
+        return;
+    }
+    recent.push_front(it);
+    it->second.position = recent.begin();
+    if (paths.size() > capacity) {
+        erase(recent.back());
+    }
+}
+
+void PathCache::invalidate(std::string_view path) {
+    std::lock_guard lock(mutex);
+    ++currentGeneration;
+    ++invalidations;
+    if (auto it = paths.find(path); it != paths.end()) {
+        erase(it);
+    }
+    // children sort right after path + "/", unlike siblings such as "path-1"
+    std::string children = std::string(path) + "/";
+    for (auto it = paths.lower_bound(children); it != paths.end() && it->first.starts_with(children);) {
+        erase(it++);
+    }
+}
+
+void PathCache::drop(std::string_view path) {
+    std::lock_guard lock(mutex);
+    ++stale;
+    if (auto it = paths.find(path); it != paths.end()) {
+        erase(it);
+    }
+}
+
+PathCache::Stats PathCache::stats() const {
+    std::lock_guard lock(mutex);
+    return {hits, prefixHits, misses, invalidations, stale, paths.size()};
+}
+
+void PathCache::erase(Map::iterator it) {
+    recent.erase(it->second.position);
+    paths.erase(it);
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Coordinates of an entity, enough to build it again without walking its path
+struct Locator {
+    enum class Kind : uint8_t {
+        Room,
+        Bookcase,
+        Shelf,
+        // books resolved on a shelf or on the desk, a room can be reached by
+        // many paths, so these are checked against the room when used
+        ShelfBook,
+        DeskBook,
+        Desk,
+        // desk items, numbered in the room in order of creation; they can be
+        // renamed through any path to their room, so they are never cached
+        Note,
+        Basket,
+    };
+
+    Kind kind;
+    int room;
+    // bookcase for Bookcase, shelf over the whole room for shelves and books
+    int index = 0;
+    // book on the shelf, or the item number of a note or basket
+    int slot = 0;
+};
+
+// Resolved paths with LRU eviction. Lookups fall back to the longest cached
+// prefix, so a walk only resolves the components past it. Entries are dropped
+// by invalidate() on every change below their path; a resolution that started
+// before an invalidation is not cached.
+class PathCache {
+public:
+    struct Stats {
+        uint64_t hits;
+        // lookups that reused a shorter cached prefix
+        uint64_t prefixHits;
+        uint64_t misses;
+        uint64_t invalidations;
+        // cached books found moved through another path to their room
+        uint64_t stale;
+        size_t size;
+    };
+
+    // capacity == 0 disables the cache
+    explicit PathCache(size_t capacity);
+
+    // Longest cached prefix of path ending at a component boundary and its
+    // locator, the length is 0 when nothing is cached
+    std::pair<size_t, std::optional<Locator>> find(std::string_view path);
+
+    // Value to pass to put() for a resolution starting now
+    uint64_t generation() const;
+
+    // Caches path unless something was invalidated since generation
+    void put(std::string_view path, const Locator &locator, uint64_t generation);
+
+    // Drops path and everything under it
+    void invalidate(std::string_view path);
+
+    // Drops just path, whose locator turned out to be stale
+    void drop(std::string_view path);
+
+    Stats stats() const;
+
+private:
+    struct Entry;
+    using Map = std::map<std::string, Entry, std::less<>>;
+
+    struct Entry {
+        Locator locator;
+        std::list<Map::iterator>::iterator position;
+    };
+
+    void erase(Map::iterator it);
+
+    mutable std::mutex mutex;
+    size_t capacity;
+    Map paths;
+    // most recently used first
+    std::list<Map::iterator> recent;
+    uint64_t currentGeneration = 0;
+    uint64_t hits = 0, prefixHits = 0, misses = 0, invalidations = 0, stale = 0;
+};
@@ -0,0 +1,31 @@
+#include "readahead.h"
+
+#include <algorithm>
+
+Readahead::Readahead(uint64_t blockSize, uint64_t maxWindow) : blockSize(blockSize), maxWindow(maxWindow) {}
+
+std::pair<uint64_t, uint64_t> Readahead::onRead(uint64_t offset, size_t size) {
+    std::lock_guard lock(mutex);
+    if (offset == nextOffset) {
+        ++sequentialReads;
+    } else {
+        sequentialReads = 0;
+        window = 0;
+        prefetchedUntil = 0;
+    }
+    nextOffset = offset + size;
+
+    if (sequentialReads < 2 || maxWindow == 0) {
+        return {0, 0};
+    }
+    window = window == 0 ? std::min(initialWindow, maxWindow) : std::min(window * 2, maxWindow);
+
+    // the block after the one being read is the first worth generating ahead
+    uint64_t first = std::max(prefetchedUntil, (nextOffset + blockSize - 1) / blockSize);
+    uint64_t last = (nextOffset + blockSize - 1) / blockSize + window;
+    if (first >= last) {
+        return {0, 0};
+    }
+    prefetchedUntil = last;
+    return {first, last};
+}
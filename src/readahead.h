@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+
+// Access pattern of one open file. After two reads that continue each other
+// the window of blocks to generate ahead opens and doubles with every further
+// sequential read, a read elsewhere closes it again.
+class Readahead {
+public:
+    // maxWindow is in blocks of blockSize bytes
+    Readahead(uint64_t blockSize, uint64_t maxWindow);
+
+    // Records a read, returns the blocks [first, last) to prefetch now
+    std::pair<uint64_t, uint64_t> onRead(uint64_t offset, size_t size);
+
+private:
+    static constexpr uint64_t initialWindow = 2;
+
+    const uint64_t blockSize;
+    const uint64_t maxWindow;
+
+    std::mutex mutex;
+    uint64_t nextOffset = 0;
+    int sequentialReads = 0;
+    uint64_t window = 0;
+    // blocks before this one were already handed out for prefetching
+    uint64_t prefetchedUntil = 0;
+};
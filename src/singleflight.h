@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+
+// Collapses concurrent calls for the same key: the first caller computes the
+// value, callers arriving while it runs wait for it and get the same result.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class SingleFlight {
+public:
+    struct Stats {
+        // calls that did the work
+        uint64_t leaders;
+        // calls that reused the result of a call in flight
+        uint64_t shared;
+    };
+
+    template <typename Fn>
+    Value run(const Key &key, Fn &&fn) {
+        std::unique_lock lock(mutex);
+        if (auto it = flights.find(key); it != flights.end()) {
+            auto future = it->second;
+            lock.unlock();
+            ++shared;
+            return future.get();
+        }
+        std::promise<Value> promise;
+        flights.emplace(key, promise.get_future().share());
+        lock.unlock();
+        ++leaders;
+
+        try {
+            Value value = fn();
+            promise.set_value(value);
+            finish(key);
+            return value;
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+            finish(key);
+            throw;
+        }
+    }
+
+    Stats stats() const {
+        return {leaders, shared};
+    }
+
+private:
+    void finish(const Key &key) {
+        std::lock_guard lock(mutex);
+        flights.erase(key);
+    }
+
+    std::mutex mutex;
+    std::unordered_map<Key, std::shared_future<Value>, Hash> flights;
+    std::atomic<uint64_t> leaders{0}, shared{0};
+};
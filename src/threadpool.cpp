@@ -0,0 +1,126 @@
+#include "threadpool.h"
+
+#include <exception>
+
+ThreadPool::ThreadPool(size_t threads) {
+    for (size_t i = 0; i < threads; ++i) {
+        queues.push_back(std::make_unique<Queue>());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back([this, i] { workerLoop(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(sleepMutex);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+size_t ThreadPool::size() const {
+    return workers.size();
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    if (queues.empty()) {
+        task();
+        return;
+    }
+    auto &queue = *queues[nextQueue++ % queues.size()];
+    {
+        std::lock_guard lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard lock(sleepMutex);
+        ++queued;
+    }
+    wakeUp.notify_one();
+}
+
+bool ThreadPool::runOne(size_t home) {
+    std::function<void()> task;
+    for (size_t i = 0; i < queues.size() && !task; ++i) {
+        auto &queue = *queues[(home + i) % queues.size()];
+        std::lock_guard lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+        if (i == 0) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+    }
+    if (!task) {
+        return false;
+    }
+    --queued;
+    task();
+    return true;
+}
+
+void ThreadPool::workerLoop(size_t index) {
+    while (true) {
+        if (runOne(index)) {
+            continue;
+        }
+        std::unique_lock lock(sleepMutex);
+        wakeUp.wait(lock, [this] { return stopping || queued > 0; });
+        if (stopping && queued == 0) {
+            return;
+        }
+    }
+}
+
+void ThreadPool::parallelFor(size_t n, const std::function<void(size_t)> &fn) {
+    if (queues.empty() || n <= 1) {
+        for (size_t i = 0; i < n; ++i) {
+            fn(i);
+        }
+        return;
+    }
+
+    struct Batch {
+        std::atomic<size_t> remaining;
+        std::mutex mutex;
+        std::condition_variable done;
+        std::exception_ptr error;
+    };
+    auto batch = std::make_shared<Batch>();
+    batch->remaining = n;
+
+    for (size_t i = 0; i < n; ++i) {
+        submit([batch, &fn, i] {
+            try {
+                fn(i);
+            } catch (...) {
+                std::lock_guard lock(batch->mutex);
+                batch->error = std::current_exception();
+            }
+            if (--batch->remaining == 0) {
+                std::lock_guard lock(batch->mutex);
+                batch->done.notify_all();
+            }
+        });
+    }
+
+    // help instead of blocking while there is anything to run
+    size_t home = nextQueue++;
+    while (batch->remaining > 0) {
+        if (!runOne(home)) {
+            std::unique_lock lock(batch->mutex);
+            batch->done.wait(lock, [&] { return batch->remaining == 0; });
+        }
+    }
+    if (batch->error) {
+        std::rethrow_exception(batch->error);
+    }
+}
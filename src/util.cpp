@@ -1,8 +1,9 @@
 #include "util.h"
+#include "alphabet.h"
+#include <algorithm>
+#include <charconv>
 #include <random>
 
-static const std::string possibleSymbols = "abcdefghijklmnopqrstuvwxyz.,";
-
 std::string generateStringFromSeed(const std::string &seed, int len) {
     std::mt19937 rng;
     rng.seed(std::hash<std::string>{}(seed));
@@ -14,3 +15,54 @@ std::string generateStringFromSeed(const std::string &seed, int len) {
 
     return res;
 }
+
+std::optional<size_t> parseSize(std::string_view text) {
+    size_t value = 0;
+    auto [rest, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (error != std::errc() || rest == text.data()) {
+        return std::nullopt;
+    }
+    std::string_view suffix(rest, text.data() + text.size() - rest);
+    int shift = 0;
+    if (suffix == "K" || suffix == "k") {
+        shift = 10;
+    } else if (suffix == "M" || suffix == "m") {
+        shift = 20;
+    } else if (suffix == "G" || suffix == "g") {
+        shift = 30;
+    } else if (!suffix.empty()) {
+        return std::nullopt;
+    }
+    if (value > (SIZE_MAX >> shift)) {
+        return std::nullopt;
+    }
+    return value << shift;
+}
+
+PathSplitter::PathSplitter(std::string_view path, size_t position) : path(path), end(position) {}
+
+std::string_view PathSplitter::next() {
+    size_t begin = path.find_first_not_of('/', end);
+    if (begin == std::string_view::npos) {
+        end = path.size();
+        return {};
+    }
+    end = std::min(path.find('/', begin), path.size());
+    return path.substr(begin, end - begin);
+}
+
+size_t PathSplitter::position() const {
+    return end;
+}
+
+std::pair<std::string_view, std::string_view> splitParent(std::string_view path) {
+    while (path.size() > 1 && path.back() == '/') {
+        path.remove_suffix(1);
+    }
+    size_t slash = path.rfind('/');
+    if (slash == std::string_view::npos) {
+        return {{}, path};
+    }
+    // the parent of a top level entry is the root itself
+    return {path.substr(0, std::max<size_t>(slash, 1)), path.substr(slash + 1)};
+}
@@ -1,5 +1,32 @@
 #pragma once
 
+#include <cstddef>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <utility>
 
+// Reference implementation of the legacy generator, kept for compatibility checks
 std::string generateStringFromSeed(const std::string& seed, int len);
+
+// Parses a byte count with an optional K, M or G (binary) suffix
+std::optional<size_t> parseSize(std::string_view text);
+
+// Components of a slash separated path, viewed in place without copies
+class PathSplitter {
+public:
+    explicit PathSplitter(std::string_view path, size_t position = 0);
+
+    // The next component, empty once the path is exhausted
+    std::string_view next();
+
+    // Length of the path up to the end of the component returned last
+    size_t position() const;
+
+private:
+    std::string_view path;
+    size_t end;
+};
+
+// Parent directory and last component of an absolute path
+std::pair<std::string_view, std::string_view> splitParent(std::string_view path);
@@ -1,14 +1,27 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 
 #include <thread>
+#include <random>
 #include <utility>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <regex>
 #include <unordered_map>
 #include <unordered_set>
 #include "doctest.h"
 
 #include "../src/babylonfs.h"
+#include "../src/util.h"
+#include "../src/aes.h"
+#include "../src/cache.h"
+#include "../src/inodes.h"
+#include "../src/pathcache.h"
+#include "../src/readahead.h"
+#include "../src/singleflight.h"
+#include "../src/threadpool.h"
+#include "../src/engine.h"
+#include "../src/alphabet.h"
+#include "../src/logic.h"
 
 #define seed "test_seed"
 #define cycle 5
@@ -16,20 +29,35 @@
 
 namespace fs = std::filesystem;
 
+enum class Frontend { HighLevel, LowLevel };
+
 class BabylonFSKeeper {
 private:
     std::string path;
     struct fuse_args args = FUSE_ARGS_INIT(0, {});
     const struct fuse_operations *ops = BabylonFS::run(seed, cycle);
     struct fuse_chan* chan;
-    struct fuse* fuse;
+    struct fuse* fuse = nullptr;
+    struct fuse_session* session = nullptr;
     std::thread fuse_thread;
 
 public:
-    BabylonFSKeeper(std::string fs_path) : path(std::move(fs_path)) {
+    BabylonFSKeeper(std::string fs_path, Frontend frontend = Frontend::HighLevel) : path(std::move(fs_path)) {
         fs::create_directory(path);
 
         chan = fuse_mount(path.c_str(), &args);
+
+        if (frontend == Frontend::LowLevel) {
+            auto *lowLevelOps = BabylonFS::getLowLevelOps();
+            session = fuse_lowlevel_new(&args, lowLevelOps, sizeof(*lowLevelOps), nullptr);
+            fuse_session_add_chan(session, chan);
+
+            struct fuse_session *session_ptr = session;
+
+            fuse_thread = std::thread([session_ptr]() { fuse_session_loop(session_ptr); });
+            return;
+        }
+
         fuse = fuse_new(chan, &args, ops, sizeof(*ops), nullptr);
 
         struct fuse *fuse_ptr = fuse;
@@ -41,16 +69,31 @@ public:
     BabylonFSKeeper& operator=(const BabylonFSKeeper&) = delete;
 
     ~BabylonFSKeeper() {
-        fuse_exit(fuse);
-        fuse_unmount(path.c_str(), chan);
-        fuse_destroy(fuse);
+        if (session) {
+            fuse_session_exit(session);
+            fuse_unmount(path.c_str(), chan);
+            fuse_thread.join();
+            fuse_session_remove_chan(chan);
+            fuse_session_destroy(session);
+        } else {
+            fuse_exit(fuse);
+            fuse_unmount(path.c_str(), chan);
+            fuse_destroy(fuse);
 
-        fuse_thread.join();
+            fuse_thread.join();
+        }
 
         fs::remove(path);
     }
 };
 
+// Runs the rest of the test case once for each frontend, every time on a fresh mount
+#define MOUNT_EACH_FRONTEND(keeper)                                  \
+    Frontend frontend = Frontend::HighLevel;                         \
+    SUBCASE("high-level frontend") {}                                \
+    SUBCASE("low-level frontend") { frontend = Frontend::LowLevel; } \
+    BabylonFSKeeper keeper(root, frontend)
+
 void rooms_walk(const fs::path &path, int depth, int max_depth,
                 const std::function<void(const fs::path&)>& checker) {
     if (depth > max_depth) {
@@ -105,7 +148,7 @@ void books_walk(const fs::path &path, int depth, int max_depth,
 }
 
 TEST_CASE("Every room has 2 neighbour rooms") {
-    BabylonFSKeeper keeper(root);
+    MOUNT_EACH_FRONTEND(keeper);
 
     rooms_walk(fs::path(root), 0, 10, [](const fs::path &path) {
         CHECK(fs::is_directory(path));
@@ -113,7 +156,7 @@ TEST_CASE("Every room has 2 neighbour rooms") {
 }
 
 TEST_CASE("Every room has 4 cupboards") {
-    BabylonFSKeeper keeper(root);
+    MOUNT_EACH_FRONTEND(keeper);
 
     cupboards_walk(fs::path(root), 0, 5, [](const fs::path &path) {
         CHECK(fs::is_directory(path));
@@ -121,7 +164,7 @@ TEST_CASE("Every room has 4 cupboards") {
 }
 
 TEST_CASE("Cupboards cannot be removed") {
-    BabylonFSKeeper keeper(root);
+    MOUNT_EACH_FRONTEND(keeper);
 
     cupboards_walk(fs::path(root), 0, 5, [](const fs::path &path) {
         CHECK_THROWS(fs::remove(path));
@@ -129,7 +172,7 @@ TEST_CASE("Cupboards cannot be removed") {
 }
 
 TEST_CASE("Cupboards can be renamed") {
-    BabylonFSKeeper keeper(root);
+    MOUNT_EACH_FRONTEND(keeper);
 
     cupboards_walk(fs::path(root), 0, 5, [](const fs::path &path) {
         CHECK_NOTHROW(fs::rename(path, path.string() + "n"));
@@ -137,7 +180,7 @@ TEST_CASE("Cupboards can be renamed") {
 }
 
 TEST_CASE("Every cupboard has 5 shelves") {
-    BabylonFSKeeper keeper(root);
+    MOUNT_EACH_FRONTEND(keeper);
 
     cupboards_walk(fs::path(root), 0, 5, [](const fs::path &path) {
            int num_shelves = 0;
@@ -153,7 +196,7 @@ TEST_CASE("Every cupboard has 5 shelves") {
 }
 
 TEST_CASE("Shelves cannot be removed") {
-    BabylonFSKeeper keeper(root);
+    MOUNT_EACH_FRONTEND(keeper);
 
     shelves_walk(fs::path(root), 0, 5, [](const fs::path &path) {
         CHECK_THROWS(fs::remove(path));
@@ -161,7 +204,7 @@ TEST_CASE("Shelves cannot be removed") {
 }
 
 TEST_CASE("Shelves can be renamed") {
-    BabylonFSKeeper keeper(root);
+    MOUNT_EACH_FRONTEND(keeper);
 
     shelves_walk(fs::path(root), 0, 5, [](const fs::path &path) {
         CHECK_NOTHROW(fs::rename(path, path.string() + "n"));
@@ -169,7 +212,7 @@ TEST_CASE("Shelves can be renamed") {
 }
 
 TEST_CASE("Every shelf has 32 books") {
-    BabylonFSKeeper keeper(root);
+    MOUNT_EACH_FRONTEND(keeper);
 
     shelves_walk(fs::path(root), 0, 5, [](const fs::path &path) {
         int num_books = 0;
@@ -181,7 +224,7 @@ TEST_CASE("Every shelf has 32 books") {
 }
 
 TEST_CASE("Books naming") {
-    BabylonFSKeeper keeper(root);
+    MOUNT_EACH_FRONTEND(keeper);
 
     books_walk(fs::path(root), 0, 1, [](const fs::path &path) {
         CHECK(std::regex_match(path.filename().string(), std::regex("[a-z.,]+")));
@@ -189,7 +232,7 @@ TEST_CASE("Books naming") {
 }
 
 TEST_CASE("Book sizes") {
-    BabylonFSKeeper keeper(root);
+    MOUNT_EACH_FRONTEND(keeper);
 
     books_walk(fs::path(root), 0, 1, [](const fs::path &path) {
         CHECK(fs::file_size(path) == 4096 * 256);
@@ -197,7 +240,7 @@ TEST_CASE("Book sizes") {
 }
 
 TEST_CASE("Book permissions") {
-    BabylonFSKeeper keeper(root);
+    MOUNT_EACH_FRONTEND(keeper);
 
     books_walk(fs::path(root), 0, 1, [](const fs::path &path) {
         CHECK((fs::status(path).permissions() & fs::perms::others_read) == fs::perms::others_read);
@@ -206,14 +249,14 @@ TEST_CASE("Book permissions") {
 }
 
 TEST_CASE("Every room has desk") {
-    BabylonFSKeeper keeper(root);
+    MOUNT_EACH_FRONTEND(keeper);
     desks_walk(fs::path(root), 0, 7, [](const fs::path &path) {
         CHECK(fs::is_directory(path));
     });
 }
 
 TEST_CASE("Can create and remove files and directories on desk") {
-    BabylonFSKeeper keeper(root);
+    MOUNT_EACH_FRONTEND(keeper);
     desks_walk(fs::path(root), 0, 0, [](const fs::path &path) {
         auto tmp_dir_path = path;
         tmp_dir_path.append("tmp_dir");
@@ -231,7 +274,7 @@ TEST_CASE("Can create and remove files and directories on desk") {
 }
 
 TEST_CASE("Can create and remove files and directories on desk") {
-    BabylonFSKeeper keeper(root);
+    MOUNT_EACH_FRONTEND(keeper);
     desks_walk(fs::path(root), 0, 0, [](const fs::path &path) {
         auto tmp_dir_path = path;
         tmp_dir_path.append("tmp_dir");
@@ -249,7 +292,7 @@ TEST_CASE("Can create and remove files and directories on desk") {
 }
 
 TEST_CASE("Cannot create recursive subfolders on desk") {
-    BabylonFSKeeper keeper(root);
+    MOUNT_EACH_FRONTEND(keeper);
     desks_walk(fs::path(root), 0, 0, [](const fs::path &path) {
         auto tmp_dir_path = path;
         tmp_dir_path.append("tmp_dir");
@@ -261,7 +304,7 @@ TEST_CASE("Cannot create recursive subfolders on desk") {
 }
 
 TEST_CASE("Can move books to desk and back") {
-    BabylonFSKeeper keeper(root);
+    MOUNT_EACH_FRONTEND(keeper);
     books_walk(fs::path(root), 0, 0, [](const fs::path &path) {
         auto on_desk_path = path.parent_path().parent_path().parent_path()
                 .append("desk").append(path.filename().string());
@@ -271,7 +314,7 @@ TEST_CASE("Can move books to desk and back") {
 }
 
 TEST_CASE("Can't move books to another place") {
-    BabylonFSKeeper keeper(root);
+    MOUNT_EACH_FRONTEND(keeper);
     books_walk(fs::path(root), 0, 0, [](const fs::path &path) {
         auto on_desk_path = path.parent_path().parent_path().parent_path()
                 .append("desk").append(path.filename().string());
@@ -291,7 +334,7 @@ TEST_CASE("Can't move books to another place") {
 }
 
 TEST_CASE("Cyclic library") {
-    BabylonFSKeeper keeper(root);
+    MOUNT_EACH_FRONTEND(keeper);
 
     std::unordered_map<std::string, std::unordered_set<std::string>> room_books;
 
@@ -314,3 +357,559 @@ TEST_CASE("Cyclic library") {
 
     CHECK(room_books.size() == 5 + 1); // also root directory
 }
+
+TEST_CASE("Content engines are seekable") {
+    for (auto engine : ContentEngine::all()) {
+        auto full = engine->generate("test_seed:book", 20000);
+        CHECK(std::regex_match(full, std::regex("[a-z.,]+")));
+
+        for (auto [offset, size] : {std::pair{0, 20000}, {1, 3}, {3, 9}, {1000, 1}, {2047, 6000}, {19999, 1}}) {
+            std::string part(size, '\0');
+            engine->generate("test_seed:book", offset, part.data(), part.size());
+            CHECK(part == full.substr(offset, size));
+        }
+    }
+}
+
+TEST_CASE("Content engines output is frozen") {
+    // the legacy engine depends on std::hash and is checked against the reference implementation instead
+    CHECK(ContentEngine::find("xoshiro256")->generate("test_seed:book", 24) == ".howfirxmltkciaajshyzcun");
+    CHECK(ContentEngine::find("splitmix64")->generate("test_seed:book", 24) == "acuzupzgbahrifsrgwvjrumk");
+    CHECK(ContentEngine::find("philox")->generate("test_seed:book", 24) == "qveiwjk.kzrkekqpkdscqhti");
+    CHECK(ContentEngine::find("aes-ctr")->generate("test_seed:book", 24) == "tzsqbdif.mx,jchmsrekunnn");
+}
+
+TEST_CASE("Legacy generator matches the reference implementation") {
+    auto &legacy = *ContentEngine::find("legacy-mt19937");
+    for (int len : {0, 1, 16, 511, 512, 513, 5000}) {
+        CHECK(legacy.generate("test_seed:" + std::to_string(len), len) ==
+              generateStringFromSeed("test_seed:" + std::to_string(len), len));
+    }
+
+    const int bookSize = 4096 * 256;
+    auto full = generateStringFromSeed("test_seed:book", bookSize);
+    // reads past the first checkpoint, then reads resuming from recorded checkpoints
+    for (auto [offset, size] : {std::pair{700000, 4096}, {0, 4096}, {65535, 2}, {131072, 131072},
+                                {700001, 10}, {bookSize - 1, 1}, {300000, 4096}}) {
+        std::string part(size, '\0');
+        legacy.generate("test_seed:book", offset, part.data(), part.size());
+        CHECK(part == full.substr(offset, size));
+    }
+}
+
+TEST_CASE("Legacy checkpoints of a large book stay bounded") {
+    auto &legacy = *ContentEngine::find("legacy-mt19937");
+    // a streamed 32 MiB book records 512 checkpoints of about 2.5 KiB
+    const uint64_t bookSize = 32 << 20, chunk = 1 << 20;
+    std::string part(chunk, '\0'), middle;
+    for (uint64_t offset = 0; offset < bookSize; offset += chunk) {
+        legacy.generate("test_seed:large", offset, part.data(), part.size());
+        if (offset == 21 * chunk) {
+            middle = part.substr(12345, 100);
+        }
+    }
+    CHECK(legacyCheckpointMemory() < (1 << 20));
+
+    // thinned checkpoints still resume reads where they left off
+    std::string again(100, '\0');
+    legacy.generate("test_seed:large", 21 * chunk + 12345, again.data(), again.size());
+    CHECK(again == middle);
+}
+
+TEST_CASE("SIMD symbol kernels match the scalar kernel") {
+    std::mt19937 rng(42);
+    std::vector<uint32_t> words(1000);
+    for (auto &word : words) {
+        word = rng();
+    }
+    // extremes and bucket boundaries, word 0 is rejected by Lemire's reduction
+    words[996] = 0;
+    words[997] = UINT32_MAX;
+    words[998] = 153391689;
+    words[999] = 153391688;
+
+    auto level = detectSimdLevel();
+    for (auto candidate : {SimdLevel::Scalar, SimdLevel::Sse42, SimdLevel::Avx2}) {
+        if (candidate > level) {
+            continue;
+        }
+        for (size_t n : {size_t{0}, size_t{15}, size_t{16}, size_t{33}, words.size()}) {
+            for (uint32_t threshold : {0u, 4u}) {
+                std::string expected(n, '\0'), actual(n, '\0');
+                bool expectedAccepted = mapToSymbols(SimdLevel::Scalar, words.data(), n, expected.data(), threshold);
+                bool accepted = mapToSymbols(candidate, words.data(), n, actual.data(), threshold);
+                CHECK(actual == expected);
+                CHECK(accepted == expectedAccepted);
+            }
+        }
+    }
+}
+
+TEST_CASE("Custom alphabets and binary texts") {
+    std::string large;
+    for (int i = 0; i < 200; ++i) {
+        large += char(i + 40);
+    }
+    auto binary = *Alphabet::parse("binary");
+    auto digits = *Alphabet::parse("01");
+    auto wide = *Alphabet::parse(large);
+    CHECK(!Alphabet::parse(""));
+    CHECK(!Alphabet::parse(std::string(257, 'a')));
+
+    std::mt19937 rng(7);
+    std::vector<uint32_t> words(1000);
+    for (auto &word : words) {
+        word = rng();
+    }
+    auto level = detectSimdLevel();
+    for (auto candidate : {SimdLevel::Scalar, SimdLevel::Sse42, SimdLevel::Avx2}) {
+        if (candidate > level) {
+            continue;
+        }
+        for (const Alphabet *alphabet : {&digits, &wide}) {
+            std::string expected(words.size(), '\0'), actual(words.size(), '\0');
+            alphabet->map(SimdLevel::Scalar, words.data(), words.size(), expected.data());
+            alphabet->map(candidate, words.data(), words.size(), actual.data());
+            CHECK(actual == expected);
+        }
+    }
+
+    for (auto engine : ContentEngine::all()) {
+        if (!engine->supportsAlphabets()) {
+            continue;
+        }
+        auto key = libraryKey("test_seed");
+        std::string standard(1000, '\0');
+        engine->generate(key, 0, standard.data(), standard.size(), Alphabet::standard());
+        CHECK(standard == engine->generate(key, standard.size()));
+
+        std::string full(20000, '\0');
+        engine->generate(key, 0, full.data(), full.size(), binary);
+        CHECK(full.find_first_not_of('\0') != std::string::npos);
+        for (auto [offset, size] : {std::pair<size_t, size_t>{1, 7}, {4095, 3}, {16381, 3619}}) {
+            std::string part(size, '\0');
+            engine->generate(key, offset, part.data(), part.size(), binary);
+            CHECK(part == full.substr(offset, size));
+        }
+
+        engine->generate(key, 0, full.data(), full.size(), digits);
+        CHECK(full.find_first_not_of("01") == std::string::npos);
+    }
+}
+
+TEST_CASE("AES-NI and software AES agree") {
+    // FIPS-197 appendix C.1
+    Aes128 aes(Aes128::Key{0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+                           0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f});
+    const uint8_t plain[16] = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+                               0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+    const uint8_t cipher[16] = {0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+                                0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a};
+
+    std::vector<bool> paths = {false};
+    if (Aes128::hasHardwareSupport()) {
+        paths.push_back(true);
+    }
+
+    std::vector<std::vector<uint8_t>> keystreams;
+    for (bool hardware : paths) {
+        uint8_t out[16];
+        aes.encryptBlock(hardware, plain, out);
+        CHECK(std::equal(out, out + 16, cipher));
+
+        std::vector<uint8_t> keystream(16 * 37);
+        aes.ctr(hardware, (1ULL << 32) - 5, 37, keystream.data());
+        keystreams.push_back(keystream);
+    }
+    CHECK(keystreams.front() == keystreams.back());
+}
+
+TEST_CASE("Key derivation is stable") {
+    auto library = libraryKey("test_seed");
+    CHECK(library.lo == stableHash("test_seed"));
+    auto book = childKey(childKey(childKey(roomKey(library, -3), 2), 4), 31);
+    CHECK(book == Key128{0x3950c0025ea5a656ULL, 0xc3b9a418c1ba6d8aULL});
+    CHECK(bookNameKey(book) != bookContentKey(book));
+    CHECK(roomKey(library, 1) != roomKey(library, -1));
+}
+
+TEST_CASE("Parallel generation does not depend on the thread count") {
+    auto &engine = *ContentEngine::find("xoshiro256");
+    auto key = libraryKey("test_seed");
+    const uint64_t offset = 12345;
+    const size_t size = 3 * ContentEngine::parallelBlockSize + 777;
+
+    std::string expected(size, '\0');
+    engine.generate(key, offset, expected.data(), expected.size());
+
+    for (size_t threads : {0, 1, 3, 8}) {
+        ThreadPool pool(threads);
+        std::string actual(size, '\0');
+        engine.generate(pool, key, offset, actual.data(), actual.size());
+        CHECK(actual == expected);
+    }
+}
+
+TEST_CASE("Block cache keeps hot blocks during a scan") {
+    BlockCache cache(10 * contentBlockSize);
+    auto book = libraryKey("test_seed");
+    auto block = std::make_shared<const std::string>(contentBlockSize, 'a');
+
+    for (int round = 0; round < 5; ++round) {
+        for (uint64_t i = 0; i < 5; ++i) {
+            if (!cache.get({nullptr, book, i})) {
+                cache.put({nullptr, book, i}, block);
+            }
+        }
+    }
+    for (uint64_t i = 100; i < 1000; ++i) {
+        if (!cache.get({nullptr, book, i})) {
+            cache.put({nullptr, book, i}, block);
+        }
+    }
+    for (uint64_t i = 0; i < 5; ++i) {
+        CHECK(cache.get({nullptr, book, i}) != nullptr);
+    }
+
+    auto stats = cache.stats();
+    CHECK(stats.bytes <= stats.capacity);
+    CHECK(stats.hits >= 20 + 5);
+    CHECK(stats.misses >= 900);
+}
+
+TEST_CASE("Readahead window grows on sequential reads and stops on random access") {
+    Readahead readahead(100, 8);
+
+    CHECK(readahead.onRead(0, 100) == std::pair<uint64_t, uint64_t>{0, 0});
+    CHECK(readahead.onRead(100, 100) == std::pair<uint64_t, uint64_t>{2, 4});
+    CHECK(readahead.onRead(200, 100) == std::pair<uint64_t, uint64_t>{4, 7});
+    CHECK(readahead.onRead(300, 100) == std::pair<uint64_t, uint64_t>{7, 12});
+    CHECK(readahead.onRead(400, 100) == std::pair<uint64_t, uint64_t>{12, 13});
+    CHECK(readahead.onRead(500, 100) == std::pair<uint64_t, uint64_t>{13, 14});
+
+    CHECK(readahead.onRead(5000, 100) == std::pair<uint64_t, uint64_t>{0, 0});
+    CHECK(readahead.onRead(5100, 100) == std::pair<uint64_t, uint64_t>{0, 0});
+    CHECK(readahead.onRead(5200, 100) == std::pair<uint64_t, uint64_t>{53, 55});
+}
+
+TEST_CASE("Single flight runs concurrent calls for a key once") {
+    SingleFlight<int, int> flight;
+    std::vector<std::thread> waiters;
+    std::vector<int> results(4);
+
+    int leaderResult = flight.run(1, [&] {
+        for (size_t i = 0; i < results.size(); ++i) {
+            waiters.emplace_back([&, i] {
+                results[i] = flight.run(1, [] { return 0; });
+            });
+        }
+        // the value is published only once every waiter joined this flight
+        while (flight.stats().shared < results.size()) {
+            std::this_thread::yield();
+        }
+        return 42;
+    });
+    for (auto &waiter : waiters) {
+        waiter.join();
+    }
+
+    CHECK(leaderResult == 42);
+    CHECK(results == std::vector<int>(4, 42));
+    CHECK(flight.stats().leaders == 1);
+    CHECK(flight.stats().shared == 4);
+    CHECK(flight.run(1, [] { return 7; }) == 7);
+}
+
+TEST_CASE("Path splitter views components in place") {
+    std::string path = "//k1/b2//3/";
+    PathSplitter components(path);
+    std::vector<std::string_view> parts;
+    for (auto part = components.next(); !part.empty(); part = components.next()) {
+        CHECK(part.data() >= path.data());
+        CHECK(part.data() + part.size() <= path.data() + path.size());
+        parts.push_back(part);
+    }
+    CHECK(parts == std::vector<std::string_view>{"k1", "b2", "3"});
+
+    PathSplitter rest(path, 4);
+    CHECK(rest.next() == "b2");
+    CHECK(rest.position() == 7);
+
+    CHECK(splitParent("/k1/desk/note") == std::pair<std::string_view, std::string_view>{"/k1/desk", "note"});
+    CHECK(splitParent("/desk") == std::pair<std::string_view, std::string_view>{"/", "desk"});
+    CHECK(splitParent("/desk/basket/") == std::pair<std::string_view, std::string_view>{"/desk", "basket"});
+}
+
+TEST_CASE("Path cache reuses the longest prefix and invalidates subtrees") {
+    PathCache cache(3);
+    cache.put("/k1", {Locator::Kind::Room, 1}, cache.generation());
+    cache.put("/k1/b2", {Locator::Kind::Bookcase, 1, 2}, cache.generation());
+    cache.put("/k1/b2-x", {Locator::Kind::Desk, 1}, cache.generation());
+
+    auto [length, locator] = cache.find("/k1/b2/3/book");
+    CHECK(length == 6);
+    CHECK(locator->kind == Locator::Kind::Bookcase);
+    CHECK(cache.find("/k1/b2").first == 6);
+    CHECK(cache.find("/k2").first == 0);
+
+    auto generation = cache.generation();
+    cache.invalidate("/k1/b2");
+    cache.put("/k1/b2/3", {Locator::Kind::Shelf, 1, 13}, generation);
+    CHECK(cache.find("/k1/b2/3").first == 3);
+    CHECK(cache.find("/k1/b2-x").first == 8);
+
+    cache.put("/k2", {Locator::Kind::Room, 2}, cache.generation());
+    cache.put("/k3", {Locator::Kind::Room, 3}, cache.generation());
+    CHECK(cache.find("/k1").first == 0);
+
+    auto stats = cache.stats();
+    CHECK(stats.hits == 2);
+    CHECK(stats.prefixHits == 2);
+    CHECK(stats.misses == 2);
+    CHECK(stats.invalidations == 1);
+    CHECK(stats.size == 3);
+}
+
+TEST_CASE("Inodes encode library coordinates") {
+    InodeCodec codec(4, 5, 32);
+    CHECK(codec.encode({Locator::Kind::Room, 0}) == 1);
+
+    std::vector<Locator> places = {
+        {Locator::Kind::Room, -7},
+        {Locator::Kind::Room, INT_MAX},
+        {Locator::Kind::Bookcase, 3, 2},
+        {Locator::Kind::Shelf, 3, 19},
+        {Locator::Kind::ShelfBook, 3, 19, 31},
+        {Locator::Kind::ShelfBook, -1, 0, 0},
+        {Locator::Kind::Desk, 3},
+        {Locator::Kind::Note, 3, 0, 1},
+        {Locator::Kind::Basket, 3, 0, 1},
+    };
+    std::unordered_set<uint64_t> inodes;
+    for (const auto &place : places) {
+        auto ino = codec.encode(place);
+        CHECK(inodes.insert(ino).second);
+        auto back = codec.decode(ino);
+        REQUIRE(back);
+        CHECK(back->kind == place.kind);
+        CHECK(back->room == place.room);
+        CHECK(back->index == place.index);
+        CHECK(back->slot == place.slot);
+    }
+    CHECK(codec.encode({Locator::Kind::DeskBook, 3, 19, 31}) == codec.encode({Locator::Kind::ShelfBook, 3, 19, 31}));
+
+    CHECK(!codec.decode(0));
+    CHECK(!codec.decode(codec.encode({Locator::Kind::Bookcase, 3, 2}) + 2));
+    CHECK(!codec.decode(codec.encode({Locator::Kind::Room, 3}) + 1));
+    CHECK(!codec.decode(InodeCodec::firstDynamic));
+}
+
+TEST_CASE("Directory nodes live until the kernel forgets them") {
+    InodeTable nodes;
+    auto room = nodes.lookup(1, "k1", 100);
+    auto desk = nodes.lookup(room, "desk", 200);
+    auto basket = nodes.lookup(desk, "basket", 300);
+    CHECK(InodeTable::isDynamic(room));
+    CHECK(nodes.lookup(room, "desk", 200) == desk);
+    CHECK(nodes.lookup(1, "k1", 100) == room);
+    CHECK(nodes.lookup(desk, "k1", 100) != room);
+    CHECK(nodes.get(basket)->inode == 300);
+
+    nodes.move(desk, "basket", room, "moved");
+    CHECK(nodes.get(basket)->parent == room);
+    CHECK(nodes.lookup(room, "moved", 300) == basket);
+    CHECK(nodes.lookup(desk, "basket", 300) != basket);
+
+    nodes.remove(room, "moved");
+    CHECK(nodes.get(basket)->inode == 0);
+    nodes.forget(basket, 1);
+    CHECK(nodes.get(basket));
+    nodes.forget(basket, 1);
+    CHECK(!nodes.get(basket));
+
+    nodes.forget(desk, 2);
+    CHECK(!nodes.get(desk));
+    CHECK(nodes.lookup(room, "desk", 200) != desk);
+}
+
+TEST_CASE("Room storage evicts only unchanged rooms") {
+    RoomStorage storage(-1, 2);
+    storage.beginOperation();
+
+    auto *changed = storage.getRoom(0);
+    changed->myNotes.push_back({"note", "text"});
+    auto *evicted = storage.getRoom(1);
+    auto key = evicted->key;
+    storage.getRoom(2);
+    storage.getRoom(3);
+    // the operation still holds every room it got
+    CHECK(storage.stats().resident == 4);
+    CHECK(storage.stats().evictions == 0);
+    storage.endOperation();
+
+    auto stats = storage.stats();
+    CHECK(stats.resident == 2);
+    CHECK(stats.pinned == 1);
+    CHECK(stats.evictions == 2);
+    CHECK(storage.getRoom(0) == changed);
+    CHECK(storage.getRoom(0)->myNotes.size() == 1);
+    CHECK(storage.getRoom(1)->key == key);
+}
+
+TEST_CASE("Room storage prepares neighbours in the background") {
+    BabylonFS::Settings settings;
+    settings.threads = 2;
+    BabylonFS::run(seed, -1, settings);
+
+    RoomStorage storage(-1, 0, 2, true);
+    storage.getRoom(0);
+    storage.prefetchAround(0);
+    for (int i = 0; i < 1000 && storage.stats().prefetched < 4; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+
+    auto stats = storage.stats();
+    CHECK(stats.prefetched == 4);
+    CHECK(stats.resident == 5);
+
+    // a walk stops at the room limit instead of evicting rooms that are in use
+    RoomStorage limited(-1, 3, 2, false);
+    limited.getRoom(0);
+    limited.prefetchAround(0);
+
+    // the walk finishes its bookkeeping after the counters, replacing the pool waits for it
+    BabylonFS::run(seed, cycle);
+    CHECK(limited.stats().prefetched == 2);
+    CHECK(limited.stats().resident == 3);
+    CHECK(limited.stats().evictions == 0);
+}
+
+TEST_CASE("Room notes are allocated from the room arena") {
+    RoomData room(0, -1);
+    CHECK(room.arena.allocations() == 0);
+
+    for (int i = 0; i < 100; ++i) {
+        room.myNotes.emplace_back("note" + std::to_string(i), std::string(100, 'x'));
+    }
+    room.myBaskets.try_emplace(std::pmr::string("basket")).first->second.emplace_back("inner", "text");
+
+    CHECK(room.myNotes.get_allocator().resource() == &room.arena);
+    CHECK(room.myNotes.back().second.get_allocator().resource() == &room.arena);
+    CHECK(room.basket("basket").front().first.get_allocator().resource() == &room.arena);
+    CHECK(room.arena.allocations() > 100);
+    CHECK(room.arena.heapAllocations() * 10 < room.arena.allocations());
+
+    // a large note goes back to the heap once it is removed
+    auto held = room.arena.largeBytes();
+    room.myNotes.emplace_back("large", std::string(1 << 20, 'x'));
+    CHECK(room.arena.largeBytes() > held + (1 << 20));
+    room.myNotes.pop_back();
+    CHECK(room.arena.largeBytes() < held + (1 << 20));
+}
+
+TEST_CASE("Room items are found by number") {
+    RoomData room(0, -1);
+    room.addItem("note");
+    room.addItem("basket");
+    room.addItem(RoomData::itemKey("basket", "inner"));
+    CHECK(*room.findItemKey(room.findItem("note")) == "note");
+    CHECK(*room.findItemKey(3) == "basket/inner");
+
+    room.moveItem("note", RoomData::itemKey("basket", "moved"));
+    CHECK(*room.findItemKey(1) == "basket/moved");
+    CHECK(room.findItem("note") == 0);
+
+    room.removeItems("basket");
+    CHECK(!room.findItemKey(1));
+    CHECK(!room.findItemKey(2));
+    CHECK(!room.findItemKey(3));
+    CHECK(room.items.empty());
+    CHECK(room.itemKeys.empty());
+
+    // numbers past the inode range would spill into the room bits
+    room.lastItem = InodeCodec::maxNumber - 2;
+    room.addItem("last");
+    CHECK(room.findItem("last") == int(InodeCodec::maxNumber - 1));
+    CHECK_THROWS_AS(room.addItem("more"), std::system_error);
+    CHECK(room.findItem("more") == 0);
+}
+
+TEST_CASE("Library geometry is configurable") {
+    BabylonFS::run(seed, -1);
+    CHECK(RoomData(0, -1).shelfNames(3)->names.size() == 32);
+    BabylonFS::Settings wider;
+    wider.geometry.booksPerShelf = 64;
+    BabylonFS::run(seed, -1, wider);
+    // the same shelf of the same seed, cached before with the old width
+    CHECK(RoomData(0, -1).shelfNames(3)->names.size() == 64);
+
+    BabylonFS::Settings settings;
+    settings.geometry = {11, 12, 100, 4096};
+    BabylonFS::run(seed, -1, settings);
+
+    RoomData room(0, -1);
+    Bookcase bookcase("b10", &room, 10);
+    CHECK(RoomData::shelfCount() == 132);
+    CHECK(bookcase.getContents().size() == 12);
+    CHECK(bookcase.get("11") != nullptr);
+    CHECK(bookcase.get("12") == nullptr);
+    CHECK(bookcase.get("011") == nullptr);
+
+    Shelf shelf("b1011", &room, 131);
+    auto names = shelf.getContents();
+    REQUIRE(names.size() == 100);
+    auto book = shelf.get(names[70]);
+    CHECK(dynamic_cast<File &>(*book).getSize() == 4096);
+
+    room.takeBook(131, 70);
+    CHECK(!room.isOnShelf(131, 70));
+    CHECK(room.shelfBooks(131).size() == 99);
+    room.returnBook(131, 70);
+    CHECK(room.isPristine());
+
+    BabylonFS::run(seed, cycle);
+}
+
+TEST_CASE("Entity handles are views into the room") {
+    BabylonFS::run(seed, cycle);
+    CHECK(std::is_trivially_copyable_v<EntityHandle>);
+
+    RoomData room(0, cycle);
+    EntityHandle shelf{EntityHandle::Shelf{&room, 3}};
+    auto names = shelf.getContents();
+    REQUIRE(names.size() == 32);
+    CHECK(shelf.isDirectory());
+    CHECK(!shelf.get("missing"));
+
+    auto book = shelf.get(names[5]);
+    REQUIRE(book);
+    CHECK(!book->isDirectory());
+    CHECK(book->locate()->kind == Locator::Kind::ShelfBook);
+    CHECK(book->getSize() == BabylonFS::getGeometry().bookSize);
+    CHECK(!book->get("anything"));
+    CHECK_THROWS_AS(book->list(nullptr, [](void *, const char *) {}), std::system_error);
+
+    std::string viewed(100, '\0'), built(100, '\0');
+    book->readInto(viewed.data(), viewed.size(), 5000);
+    auto entity = book->entity();
+    CHECK(dynamic_cast<Book &>(*entity).name == names[5]);
+    dynamic_cast<File &>(*entity).readInto(built.data(), built.size(), 5000);
+    CHECK(viewed == built);
+
+    room.takeBook(3, 5);
+    EntityHandle desk{EntityHandle::Desk{&room}};
+    CHECK(!shelf.get(names[5]));
+    REQUIRE(desk.get(names[5]));
+    CHECK(desk.get(names[5])->locate()->kind == Locator::Kind::DeskBook);
+    CHECK(book->inode() == desk.get(names[5])->inode());
+
+    room.myNotes.push_back({"note", "text"});
+    auto note = desk.get("note");
+    REQUIRE(note);
+    CHECK(!note->locate());
+    CHECK(note->getSize() == 4);
+    char text[4];
+    note->readInto(text, 4, 0);
+    CHECK(std::string_view(text, 4) == "text");
+    CHECK(desk.getContents() == std::vector<std::string>{"note", names[5]});
+}